@@ -0,0 +1,290 @@
+// abort, malloc, free, atol
+#include <stdlib.h>
+
+// memcpy, strcmp
+#include <string.h>
+
+// printf, fprintf, snprintf, stderr
+#include <stdio.h>
+
+// clock_gettime, CLOCK_MONOTONIC
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// luaL_openlibs
+#include <lualib.h>
+
+#include "pg-dump-splitter.h"
+
+// the lexer is fed by blocks of the same size as pg_dump_splitter reads
+
+static const long bench_io_size = 128 * 1024;
+static const long bench_default_size = 64 * 1024 * 1024;
+static const long bench_max_lexeme_size = 16 * 1024 * 1024;
+
+struct bench_input
+{
+    char *data;
+    long size;
+    long len;
+};
+
+static void
+add_to_input (struct bench_input *input, const char *add, long add_size)
+{
+    // generators check free space by is_input_full() before each piece
+
+    memcpy (input->data + input->len, add, add_size);
+    input->len += add_size;
+}
+
+static int
+is_input_full (const struct bench_input *input, long next_size)
+{
+    return input->len + next_size > input->size;
+}
+
+static void
+gen_dollar_bodies (struct bench_input *input)
+{
+    // huge dollar-quoted function bodies, a megabyte each
+
+    static const char head[] =
+            "create function f() returns void\n"
+            "    language plpgsql\n"
+            "    as $body$\n";
+    static const char line[] =
+            "begin perform g('some text', 123, \"Ident\"); end; -- x\n";
+    static const char tail[] = "$body$;\n\n";
+    const long body_size = 1024 * 1024;
+
+    while (!is_input_full (input,
+            sizeof (head) - 1 + body_size + sizeof (tail) - 1))
+    {
+        add_to_input (input, head, sizeof (head) - 1);
+
+        for (long i = 0; i + (long) sizeof (line) - 1 <= body_size;
+                i += sizeof (line) - 1)
+        {
+            add_to_input (input, line, sizeof (line) - 1);
+        }
+
+        add_to_input (input, tail, sizeof (tail) - 1);
+    }
+}
+
+static void
+gen_tiny_statements (struct bench_input *input)
+{
+    // millions of tiny statements
+
+    char buf[128];
+
+    for (long i = 0;; ++i)
+    {
+        int len = snprintf (buf, sizeof (buf),
+                "SELECT pg_catalog.setval('s%ld', %ld, true);\n", i % 97, i);
+
+        if (is_input_full (input, len)) break;
+
+        add_to_input (input, buf, len);
+    }
+}
+
+static void
+gen_comments (struct bench_input *input)
+{
+    // comment-heavy file, like a dump with verbose object headers
+
+    static const char piece[] =
+            "--\n"
+            "-- Name: some_table; Type: TABLE; Schema: public; Owner: -\n"
+            "--\n"
+            "\n"
+            "/* a multi-line comment\n"
+            " * with * stars / and slashes\n"
+            " */\n"
+            "SET default_tablespace = '';\n"
+            "\n";
+
+    while (!is_input_full (input, sizeof (piece) - 1))
+    {
+        add_to_input (input, piece, sizeof (piece) - 1);
+    }
+}
+
+static void
+gen_nested_parens (struct bench_input *input)
+{
+    // deeply nested parentheses around short expressions
+
+    const int depth = 1000;
+    const long piece_size = 7 + depth * 2 + 4 + depth * 4 + 2;
+
+    while (!is_input_full (input, piece_size))
+    {
+        add_to_input (input, "select ", 7);
+
+        for (int i = 0; i < depth; ++i) add_to_input (input, "((", 2);
+
+        add_to_input (input, "a.b ", 4);
+
+        for (int i = 0; i < depth; ++i) add_to_input (input, ")+1)", 4);
+
+        add_to_input (input, ";\n", 2);
+    }
+}
+
+static const struct bench_case
+{
+    const char *name;
+    void (*gen) (struct bench_input *input);
+} bench_cases[] =
+{
+    {"dollar_bodies", gen_dollar_bodies},
+    {"tiny_statements", gen_tiny_statements},
+    {"comments", gen_comments},
+    {"nested_parens", gen_nested_parens},
+};
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+run_case (lua_State *L)
+{
+    // lexes the input the same way as split_to_chunks does,
+    // returns number of lexemes and elapsed seconds
+
+    const struct bench_input *input = lua_touserdata (L, 1);
+    long lexemes = 0;
+
+    lua_getfield (L, LUA_REGISTRYINDEX, "lex");
+    lua_getfield (L, -1, "make_ctx");
+    lua_pushinteger (L, bench_max_lexeme_size);
+    lua_call (L, 1, 1);
+
+    int ctx_idx = lua_gettop (L);
+    double begin = now ();
+
+    for (long pos = 0;; pos += bench_io_size)
+    {
+        long block_size = input->len - pos;
+
+        if (block_size > bench_io_size) block_size = bench_io_size;
+
+        lua_getfield (L, ctx_idx, "feed");
+        lua_pushvalue (L, ctx_idx);
+
+        if (block_size > 0) lua_pushlstring (L, input->data + pos, block_size);
+        else lua_pushnil (L);
+
+        lua_pushnil (L);
+        lua_pushboolean (L, 0);
+        lua_call (L, 4, 1); // returns var: batch
+
+        lua_getfield (L, -1, "count");
+        lua_pushvalue (L, -2);
+        lua_call (L, 1, 1);
+        lexemes += lua_tointeger (L, -1);
+        lua_pop (L, 1);
+
+        lua_getfield (L, -1, "free");
+        lua_insert (L, -2);
+        lua_call (L, 1, 0);
+
+        if (block_size <= 0) break;
+    }
+
+    double elapsed = now () - begin;
+
+    lua_pushinteger (L, lexemes);
+    lua_pushnumber (L, elapsed);
+
+    return 2;
+}
+
+int
+main (int argc, char *argv[])
+{
+    // usage: lex-bench [SIZE-IN-MEGABYTES [CASE-NAME]]
+
+    long size = argc > 1 ? atol (argv[1]) * 1024 * 1024 : bench_default_size;
+    const char *only_case = argc > 2 ? argv[2] : 0;
+    int exit_code = 0;
+
+    if (size <= 0)
+    {
+        fprintf (stderr, "invalid input size: %s\n", argv[1]);
+        return 2;
+    }
+
+    struct bench_input input =
+    {
+        .data = malloc (size),
+        .size = size,
+    };
+
+    lua_State *L = luaL_newstate ();
+
+    if (__builtin_expect (!input.data || !L, 0))
+    {
+        fprintf (stderr, "memory allocation error for benchmark input\n");
+        abort ();
+    }
+
+    luaL_openlibs (L);
+    luaL_requiref (L, "lex", luaopen_lex, 0);
+    lua_setfield (L, LUA_REGISTRYINDEX, "lex");
+
+    for (size_t i = 0; i < sizeof (bench_cases) / sizeof (*bench_cases); ++i)
+    {
+        const struct bench_case *bench_case = &bench_cases[i];
+
+        if (only_case && strcmp (only_case, bench_case->name)) continue;
+
+        input.len = 0;
+        bench_case->gen (&input);
+
+        lua_pushcfunction (L, run_case);
+        lua_pushlightuserdata (L, &input);
+
+        if (lua_pcall (L, 1, 2, 0))
+        {
+            fprintf (stderr, "%s: %s\n", bench_case->name,
+                    lua_tostring (L, -1));
+            lua_pop (L, 1);
+            exit_code = 1;
+            continue;
+        }
+
+        long lexemes = lua_tointeger (L, -2);
+        double elapsed = lua_tonumber (L, -1);
+
+        lua_pop (L, 2);
+        lua_gc (L, LUA_GCCOLLECT, 0);
+
+        printf ("%-16s %8.1f MiB %10ld lexemes %8.3f s "
+                "%10.1f MiB/s %12.0f lexemes/s\n",
+                bench_case->name, input.len / (1024.0 * 1024.0),
+                lexemes, elapsed,
+                input.len / (1024.0 * 1024.0) / elapsed,
+                lexemes / elapsed);
+    }
+
+    lua_close (L);
+    free (input.data);
+
+    return exit_code;
+}
+
+// vi:ts=4:sw=4:et
@@ -16,7 +16,53 @@ luaopen_os_ext (lua_State *L);
 int
 luaopen_lex (lua_State *L);
 
+int
+luaopen_par_jobs (lua_State *L);
+
 void
 open_pg_dump_splitter (lua_State *L);
 
+// a context of the library keeps its own lua state with the hooks and
+// the rules made, then it splits any number of dumps. a context is used by
+// one thread at a time
+
+struct pg_dump_splitter_options
+{
+    int save_unprocessed;
+    int no_schema_dirs;
+    int relaxed_order;
+    int split_stateless;
+    const char *sql_footer;     // 0 for the default footer
+    const char *profile_path;   // 0 if matching is not profiled
+    const char *hooks_path;     // 0 if there are no hooks
+    int jobs;                   // threads sorting chunks, 0 for one
+};
+
+struct pg_dump_splitter_ctx;
+
+// the context is made even if the hooks or the rules fail, then its
+// splitting functions return the error
+
+struct pg_dump_splitter_ctx *
+pg_dump_splitter_make_ctx (const struct pg_dump_splitter_options *options);
+
+// the splitting functions return 0 on success, -1 on error,
+// see pg_dump_splitter_error()
+
+int
+pg_dump_splitter_split (struct pg_dump_splitter_ctx *ctx,
+        const char *dump_path, const char *output_dir);
+
+int
+pg_dump_splitter_split_buffer (struct pg_dump_splitter_ctx *ctx,
+        const char *data, size_t size, const char *output_dir);
+
+// message of the last error, 0 if the last call succeeded
+
+const char *
+pg_dump_splitter_error (const struct pg_dump_splitter_ctx *ctx);
+
+void
+pg_dump_splitter_free_ctx (struct pg_dump_splitter_ctx *ctx);
+
 // vi:ts=4:sw=4:et
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+
+import sys
+
+CHAR_NAMES = {
+    'nul': 0,
+    'sp': ord(' '),
+    'tab': ord('\t'),
+    'nl': ord('\n'),
+    'vt': ord('\v'),
+    'cr': ord('\r'),
+    'hash': ord('#'),
+}
+
+START_ACTIONS = ('unknown', 'reset', 'skip', 'stash', 'lexeme', 'backslash')
+
+def parse_chars(words):
+    chars = []
+
+    for word in words:
+        if word in CHAR_NAMES:
+            chars.append(CHAR_NAMES[word])
+        elif len(word) == 1:
+            chars.append(ord(word))
+        elif len(word) == 3 and word[1] == '-' and word[0] <= word[2]:
+            chars.extend(range(ord(word[0]), ord(word[2]) + 1))
+        else:
+            raise AssertionError('invalid char: {!r}'.format(word))
+
+    return chars
+
+def parse_tables(input_path):
+    classes = ['other']
+    char_classes = [0] * 256
+    starts = {}
+    keeps = {}
+    spans = {}
+
+    with open(input_path, encoding='utf-8') as in_fd:
+        for line_no, line in enumerate(in_fd, 1):
+            words = line.split()
+
+            if not words or words[0].startswith('#'):
+                continue
+
+            kind = words[0]
+            where = '{}:{}'.format(input_path, line_no)
+
+            if kind == 'class' and len(words) >= 3:
+                if words[1] in classes:
+                    raise AssertionError('{}: duplicate class'.format(where))
+
+                classes.append(words[1])
+
+                for c in parse_chars(words[2:]):
+                    if char_classes[c]:
+                        raise AssertionError(
+                            '{}: char {} is already of class {}'.format(
+                                where, c, classes[char_classes[c]]))
+
+                    char_classes[c] = len(classes) - 1
+            elif kind == 'start' and len(words) in (3, 5):
+                if words[1] not in classes or words[2] not in START_ACTIONS:
+                    raise AssertionError('{}: invalid start'.format(where))
+
+                if (words[2] == 'lexeme') != (len(words) == 5):
+                    raise AssertionError('{}: invalid start'.format(where))
+
+                starts[words[1]] = words[2:]
+            elif kind == 'keep' and len(words) >= 3:
+                for cls in words[2:]:
+                    if cls not in classes:
+                        raise AssertionError('{}: unknown class'.format(where))
+
+                keeps[words[1]] = words[2:]
+            elif kind == 'span' and len(words) == 3:
+                stop, = parse_chars(words[2:])
+                spans[words[1]] = stop
+            else:
+                raise AssertionError('{}: invalid line'.format(where))
+
+    if set(starts) != set(classes):
+        raise AssertionError('start actions must be given for every class')
+
+    return classes, char_classes, starts, keeps, spans
+
+def main():
+    if len(sys.argv) != 3:
+        raise AssertionError('len(sys.argv) != 3')
+
+    input_path = sys.argv[1]
+    output_h_path = sys.argv[2]
+
+    classes, char_classes, starts, keeps, spans = parse_tables(input_path)
+
+    with open(output_h_path, 'w', encoding='utf-8', newline='\n') as out_h_fd:
+        out_h_fd.write(
+            '// generated by lexgen.py, do not edit\n'
+            '\n'
+            'enum\n'
+            '{\n',
+        )
+
+        for cls in classes:
+            out_h_fd.write('    lex_class_{},\n'.format(cls))
+
+        out_h_fd.write(
+            '    lex_class_count,\n'
+            '};\n'
+            '\n'
+            'static const unsigned char lex_char_classes[256] =\n'
+            '{',
+        )
+
+        for c, cls in enumerate(char_classes):
+            out_h_fd.write('\n    ' if c % 16 == 0 else ' ')
+            out_h_fd.write('{},'.format(cls))
+
+        out_h_fd.write(
+            '\n'
+            '};\n'
+            '\n'
+            'static const struct lex_start lex_starts[lex_class_count] =\n'
+            '{\n',
+        )
+
+        for cls in classes:
+            action, *lexeme = starts[cls]
+
+            if lexeme:
+                type_, subtype = lexeme
+                out_h_fd.write(
+                    '    [lex_class_{}] = {{lex_start_{}, '
+                    'lex_type_{}, lex_subtype_{}}},\n'.format(
+                        cls, action, type_, subtype),
+                )
+            else:
+                out_h_fd.write(
+                    '    [lex_class_{}] = {{lex_start_{}}},\n'.format(
+                        cls, action),
+                )
+
+        out_h_fd.write(
+            '};\n'
+            '\n'
+            'static const unsigned char '
+            'lex_keeps[lex_subtype_count][lex_class_count] =\n'
+            '{\n',
+        )
+
+        for subtype, kept_classes in keeps.items():
+            out_h_fd.write('    [lex_subtype_{}] =\n    {{\n'.format(subtype))
+
+            for cls in kept_classes:
+                out_h_fd.write('        [lex_class_{}] = 1,\n'.format(cls))
+
+            out_h_fd.write('    },\n')
+
+        out_h_fd.write(
+            '};\n'
+            '\n'
+            'static const char lex_span_stops[lex_subtype_count] =\n'
+            '{\n',
+        )
+
+        for subtype, stop in spans.items():
+            out_h_fd.write(
+                '    [lex_subtype_{}] = {},\n'.format(subtype, stop),
+            )
+
+        out_h_fd.write('};\n')
+
+if __name__ == '__main__':
+    main()
+
+# vi:ts=4:sw=4:et
@@ -1,6 +1,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "pg-dump-splitter-config.h"
 #include "pg-dump-splitter.h"
 
 void
@@ -15,6 +16,11 @@ open_pg_dump_splitter (lua_State *L)
 
     lua_pop (L, 5);
 
+#ifdef PG_DUMP_SPLITTER_PAR_JOBS
+    luaL_requiref (L, "par_jobs", luaopen_par_jobs, 0);
+    lua_pop (L, 1);
+#endif
+
     luaL_requiref (L, "pg_dump_splitter", luaopen_pg_dump_splitter, 0);
 }
 
@@ -7,12 +7,35 @@
 // fprintf, stderr
 #include <stdio.h>
 
+// va_list, va_start, va_end
+#include <stdarg.h>
+
+// clock, clock_t, CLOCKS_PER_SEC
+#include <time.h>
+
+#if defined (__AVX2__)
+// _mm256_* intrinsics
+#include <immintrin.h>
+#elif defined (__SSE2__)
+// _mm_* intrinsics
+#include <emmintrin.h>
+#endif
+
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "pg-dump-splitter.h"
+#include "os-ext.h"
+#include "pt-match.h"
 
 static const long lex_buf_init_size = 1024;
+static const long lex_batch_init_cap = 1024;
+
+enum
+{
+    lex_kw_max_len = 64,
+    lex_stmt_max_kws = 4,
+};
 
 enum
 {
@@ -37,17 +60,45 @@ enum
     lex_subtype_random_symbols,
     lex_subtype_sing_line_comment,
     lex_subtype_mult_line_comment,
+    lex_subtype_count,
+};
+
+enum
+{
+    lex_start_unknown,
+    lex_start_reset,
+    lex_start_skip,
+    lex_start_stash,
+    lex_start_lexeme,
+    lex_start_backslash,
+};
+
+struct lex_start
+{
+    unsigned char action;   // what the char does out of lexemes
+    unsigned char type;     // type of lexeme started by the char
+    unsigned char subtype;  // subtype of lexeme started by the char
+};
+
+// lex_char_classes lex_starts lex_keeps lex_span_stops,
+// generated from lex-tables.txt
+#include "lex-tables.h"
+
+struct lex_kw
+{
+    int id;         // keyword id, index in keyword list, 0 for free slot
+    int len;        // keyword length
+    char word[lex_kw_max_len]; // lower case keyword, not zero terminated
 };
 
 struct lex_ctx
 {
     long max_size;  // limit of lexeme buffer size
-    long pos;       // current char position in stream, 1 based
-    long line;      // current line position in stream, 1 based
-    long col;       // current column position in stream, 1 based
-    long ppos;       // previous char position in stream, 1 based
-    long pline;      // previous line position in stream, 1 based
-    long pcol;       // previous column position in stream, 1 based
+    long pos;       // position of the last char before current input block,
+                    // chars of the block are counted from it
+    long nl_pos;    // position in stream up to which newlines are counted
+    long nl_count;  // number of newlines up to nl_pos
+    long nl_last;   // position of the last newline up to nl_pos, or 0
     int type;       // current lexeme type
     int subtype;    // current lexeme subtype
     long lpos;      // current lexeme char position in stream, 1 based
@@ -57,6 +108,20 @@ struct lex_ctx
     long len;       // current lexeme length
     char *buf;      // pointer to lexeme buffer, not zero terminated
     char stash;     // stashed char, to return to it next iteration
+    long kw_cap;    // keyword hash table capacity, power of 2
+    struct lex_kw *kws; // keyword hash table
+    long level;     // parentheses level, 1 based (tracked in batch mode)
+    int in_stmt;    // a statement is started (tracked in batch mode)
+    long stmt_lpos; // position of the statement's first lexeme
+    long stmt_lline; // line position of the statement's first lexeme
+    long stmt_lcol; // column position of the statement's first lexeme
+    int stmt_nkws;  // number of the statement's first significant lexemes
+    int stmt_kws[lex_stmt_max_kws]; // keyword ids of them, 0 for others
+    struct pt_match_prog *match_prog; // pattern rules, or 0 if statements
+                    // are matched by split_to_chunks
+    struct pt_match_run *match_run; // matching of the current statement
+    int match_profile; // statements are timed
+    clock_t stmt_clock; // processor time at the statement's beginning
     union lex_ctx_state
     {
         struct lex_ctx_state_number
@@ -71,21 +136,90 @@ struct lex_ctx
     } state;       // type's specific state
 };
 
-static inline void
-set_lpos (struct lex_ctx *ctx)
+struct lex_stmt
 {
-    ctx->lpos = ctx->pos;
-    ctx->lline = ctx->line;
-    ctx->lcol = ctx->col;
-}
+    long begin_pos;     // position of the first lexeme, 1 based
+    long end_pos;       // position after the final ``;``
+    long last_i;        // index of the final ``;`` in batch
+    int nkws;           // number of the first significant lexemes
+    int kws[lex_stmt_max_kws]; // keyword ids of them, 0 for others
+    long lline;         // line position of the first lexeme
+    long lcol;          // column position of the first lexeme
+    int obj;            // matched object type index, -1 if none
+    long obj_priority;
+    long dead_end_pos;  // where patterns have failed, 0 if they haven't
+    long cap_off;       // captured values in lex_batch.caps
+    int cap_count;
+    long lexemes;       // lexemes matched, comments aren't counted
+    long peak_states;   // the most states of patterns alive at once
+    double elapsed;     // processor seconds, if the matcher profiles
+};
 
-static inline void
-set_plpos (struct lex_ctx *ctx)
+struct lex_stmt_cap
 {
-    ctx->lpos = ctx->ppos;
-    ctx->lline = ctx->pline;
-    ctx->lcol = ctx->pcol;
-}
+    int key;            // key index
+    int op;             // which rule captured the value
+    int subtype;
+    long aux;
+    long off;           // value in lex_batch.cap_bytes
+    long len;
+};
+
+struct lex_batch
+{
+    int trans_more;     // translate more?
+    long count;         // number of lexemes
+    long cap;           // allocated number of lexemes
+    unsigned char *type;    // lexeme types
+    unsigned char *subtype; // lexeme subtypes
+    long *lpos;         // lexeme char positions in stream, 1 based
+    long *lline;        // lexeme line positions in stream, 1 based
+    long *lcol;         // lexeme column positions in stream, 1 based
+    long input_off;     // offset of input block in its map, 0 for string
+    long *voff;         // value offsets in input block,
+                        // or ``-1 - offset`` in extra buffer
+    long *vlen;         // value lengths
+    long *aux;          // subtype's specific: keyword id of simple ident,
+                        // marker length of dollar string
+    long *level;        // parentheses levels of lexemes
+    long level_error_i; // first lexeme falling below level 1, plus 1
+    long stmt_count;    // number of statements finished in the batch
+    long stmt_cap;      // allocated number of statements
+    struct lex_stmt *stmts; // statements finished in the batch
+    int has_pending;    // the stream is ended inside of a statement
+    struct lex_stmt pending; // that statement
+    long cap_count;     // number of captured values of the statements
+    long cap_cap;       // allocated number of them
+    struct lex_stmt_cap *caps; // captured values of the statements
+    long cap_bytes_len;
+    long cap_bytes_size;
+    char *cap_bytes;    // bytes of the captured values
+    long extra_size;    // extra buffer allocated size
+    long extra_len;     // extra buffer used length
+    char *extra;        // values of lexemes started in previous input blocks
+};
+
+struct lex_loc
+{
+    long pos;       // char position in stream, 1 based
+    long line;      // line position in stream, 1 based
+    long col;       // column position in stream, 1 based
+};
+
+struct lex_feed_ctx
+{
+    lua_State *L;
+    struct lex_ctx *ctx;
+    struct lex_batch *batch; // batch to collect lexemes, or 0 for callback
+    int keywords_idx;   // stack index of keyword list
+    int trans_more;
+    const char *input;  // current input block
+    size_t input_i;     // current char index in input block
+    const char *lexeme; // current lexeme inside input block, or 0 if it's
+                        // in lex_ctx buffer
+    char stash;
+    char c;
+};
 
 static void
 realloc_buf (struct lex_ctx *ctx, long need_size)
@@ -116,21 +250,36 @@ realloc_buf (struct lex_ctx *ctx, long need_size)
 }
 
 static inline void
-push_c_to_buf (lua_State *L,
-        struct lex_ctx *ctx, char add)
+check_max_size (struct lex_feed_ctx *f, long need_size)
+{
+    if (__builtin_expect (need_size > f->ctx->max_size, 0))
+    {
+        luaL_error (f->L,
+                "max_size lexeme buffer limit has exceeded: %I > %I",
+                (lua_Integer) need_size, (lua_Integer) f->ctx->max_size);
+        __builtin_unreachable ();
+    }
+}
+
+static inline void
+push_c_to_buf (struct lex_feed_ctx *f, char add)
 {
+    // a lexeme is always a continuous part of stream. so while it's
+    // inside input block, pushing chars is just counting them
+
+    struct lex_ctx *ctx = f->ctx;
     long need_size = ctx->len + 1;
 
-    if (__builtin_expect (need_size > ctx->size, 0))
+    if (f->lexeme)
     {
-        if (__builtin_expect (need_size > ctx->max_size, 0))
-        {
-            luaL_error (L,
-                    "max_size lexeme buffer limit has exceeded: %I > %I",
-                    (lua_Integer) need_size, (lua_Integer) ctx->max_size);
-            __builtin_unreachable ();
-        }
+        check_max_size (f, need_size);
+        ctx->len = need_size;
+        return;
+    }
 
+    if (__builtin_expect (need_size > ctx->size, 0))
+    {
+        check_max_size (f, need_size);
         realloc_buf (ctx, need_size);
     }
 
@@ -139,23 +288,23 @@ push_c_to_buf (lua_State *L,
 }
 
 static inline void
-push_str_to_buf (lua_State *L,
-        struct lex_ctx *ctx, const char *add, long add_size)
+push_str_to_buf (struct lex_feed_ctx *f, const char *add, long add_size)
 {
     if (__builtin_expect (!add_size, 0)) return;
 
+    struct lex_ctx *ctx = f->ctx;
     long need_size = ctx->len + add_size;
 
-    if (__builtin_expect (need_size > ctx->size, 0))
+    if (f->lexeme)
     {
-        if (__builtin_expect (need_size > ctx->max_size, 0))
-        {
-            luaL_error (L,
-                    "max_size lexeme buffer limit has exceeded: %I > %I",
-                    (lua_Integer) need_size, (lua_Integer) ctx->max_size);
-            __builtin_unreachable ();
-        }
+        check_max_size (f, need_size);
+        ctx->len = need_size;
+        return;
+    }
 
+    if (__builtin_expect (need_size > ctx->size, 0))
+    {
+        check_max_size (f, need_size);
         realloc_buf (ctx, need_size);
     }
 
@@ -163,6 +312,292 @@ push_str_to_buf (lua_State *L,
     ctx->len += add_size;
 }
 
+static inline const char *
+lexeme_buf (struct lex_feed_ctx *f)
+{
+    return f->lexeme ? f->lexeme : f->ctx->buf;
+}
+
+static void
+spill_lexeme (struct lex_feed_ctx *f)
+{
+    // the input block is going to be released by the caller,
+    // so an unfinished lexeme has to be copied to lex_ctx buffer
+
+    struct lex_ctx *ctx = f->ctx;
+
+    if (!f->lexeme || !ctx->len) return;
+
+    if (ctx->len > ctx->size) realloc_buf (ctx, ctx->len);
+
+    memcpy (ctx->buf, f->lexeme, ctx->len);
+    f->lexeme = 0;
+}
+
+static inline void
+count_mask_newlines (unsigned mask, size_t offset,
+        size_t *nl_count, size_t *nl_last)
+{
+    if (!mask) return;
+
+    *nl_count += __builtin_popcount (mask);
+    *nl_last = offset + (sizeof (mask) * 8 - 1) - __builtin_clz (mask);
+}
+
+static size_t
+scan_span (const char *input, size_t input_len, char stop)
+{
+    // returns length of the span before the first ``stop`` or zero char
+
+    size_t i = 0;
+
+#if defined (__AVX2__)
+    const __m256i stop_32 = _mm256_set1_epi8 (stop);
+    const __m256i zero_32 = _mm256_setzero_si256 ();
+
+    for (; i + 32 <= input_len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (input + i));
+        unsigned stop_mask = _mm256_movemask_epi8 (_mm256_or_si256 (
+                _mm256_cmpeq_epi8 (v, stop_32),
+                _mm256_cmpeq_epi8 (v, zero_32)));
+
+        if (stop_mask) return i + __builtin_ctz (stop_mask);
+    }
+#endif
+
+#if defined (__AVX2__) || defined (__SSE2__)
+    const __m128i stop_16 = _mm_set1_epi8 (stop);
+    const __m128i zero_16 = _mm_setzero_si128 ();
+
+    for (; i + 16 <= input_len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (input + i));
+        unsigned stop_mask = _mm_movemask_epi8 (_mm_or_si128 (
+                _mm_cmpeq_epi8 (v, stop_16),
+                _mm_cmpeq_epi8 (v, zero_16)));
+
+        if (stop_mask) return i + __builtin_ctz (stop_mask);
+    }
+#endif
+
+    for (; i < input_len; ++i)
+    {
+        char c = input[i];
+
+        if (c == stop || !c) break;
+    }
+
+    return i;
+}
+
+static size_t
+count_newlines (const char *input, size_t input_len, size_t *nl_last)
+{
+    // returns number of newlines in the input,
+    // ``nl_last`` gets offset of the last of them
+
+    size_t nl_count = 0;
+    size_t i = 0;
+
+#if defined (__AVX2__)
+    const __m256i nl_32 = _mm256_set1_epi8 ('\n');
+
+    for (; i + 32 <= input_len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (input + i));
+
+        count_mask_newlines (_mm256_movemask_epi8 (
+                _mm256_cmpeq_epi8 (v, nl_32)), i, &nl_count, nl_last);
+    }
+#endif
+
+#if defined (__AVX2__) || defined (__SSE2__)
+    const __m128i nl_16 = _mm_set1_epi8 ('\n');
+
+    for (; i + 16 <= input_len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (input + i));
+
+        count_mask_newlines (_mm_movemask_epi8 (
+                _mm_cmpeq_epi8 (v, nl_16)), i, &nl_count, nl_last);
+    }
+#endif
+
+    for (; i < input_len; ++i)
+    {
+        if (input[i] == '\n')
+        {
+            ++nl_count;
+            *nl_last = i;
+        }
+    }
+
+    return nl_count;
+}
+
+static inline long
+cur_pos (struct lex_feed_ctx *f)
+{
+    // position of current char in stream, 1 based.
+    // zero char isn't counted, it's the final mark of stream
+
+    return f->ctx->pos + f->input_i + (f->c ? 1 : 0);
+}
+
+static struct lex_loc
+locate (struct lex_feed_ctx *f, long pos)
+{
+    // line and column are found lazily: newlines are counted from the last
+    // located position. it never goes back, and the lexer never locates
+    // chars before current input block, which are not available anymore
+
+    struct lex_ctx *ctx = f->ctx;
+
+    if (__builtin_expect (pos < ctx->nl_pos, 0))
+    {
+        fprintf (stderr, "unexpected program flow\n");
+        abort ();
+    }
+
+    if (pos > ctx->nl_pos)
+    {
+        size_t nl_last;
+        size_t nl_count = count_newlines (f->input + ctx->nl_pos - ctx->pos,
+                pos - ctx->nl_pos, &nl_last);
+
+        if (nl_count)
+        {
+            ctx->nl_count += nl_count;
+            ctx->nl_last = ctx->nl_pos + nl_last + 1;
+        }
+
+        ctx->nl_pos = pos;
+    }
+
+    return (struct lex_loc)
+    {
+        .pos = pos,
+        .line = pos ? ctx->nl_count + 1 : 0,
+        .col = pos - ctx->nl_last,
+    };
+}
+
+static inline void
+set_lpos (struct lex_feed_ctx *f)
+{
+    struct lex_loc loc = locate (f, cur_pos (f));
+
+    f->ctx->lpos = loc.pos;
+    f->ctx->lline = loc.line;
+    f->ctx->lcol = loc.col;
+
+    // the lexeme starts from current char, so it's inside input block
+
+    f->lexeme = f->input + f->input_i;
+}
+
+static inline void
+set_plpos (struct lex_feed_ctx *f)
+{
+    // previous char position is the same, if current char is zero one
+
+    struct lex_loc loc = locate (f, f->ctx->pos + f->input_i);
+
+    f->ctx->lpos = loc.pos;
+    f->ctx->lline = loc.line;
+    f->ctx->lcol = loc.col;
+
+    // the lexeme starts from previous char, which was stashed.
+    // it could be the last char of previous input block
+
+    f->lexeme = f->input_i ? f->input + f->input_i - 1 : 0;
+}
+
+static void
+lex_error (struct lex_feed_ctx *f, const char *fmt, ...)
+{
+    struct lex_loc loc = locate (f, cur_pos (f));
+    va_list args;
+
+    va_start (args, fmt);
+    lua_pushvfstring (f->L, fmt, args);
+    va_end (args);
+
+    luaL_error (f->L, "pos(%I) line(%I) col(%I): %s",
+            (lua_Integer) loc.pos,
+            (lua_Integer) loc.line,
+            (lua_Integer) loc.col,
+            lua_tostring (f->L, -1));
+    __builtin_unreachable ();
+}
+
+static inline char
+lower_c (char c)
+{
+    // ASCII only, just like string.lower() in C locale
+
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline unsigned long
+hash_keyword (const char *word, long len)
+{
+    unsigned long hash = 2166136261u;
+
+    for (long i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char) word[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int
+find_keyword (const struct lex_ctx *ctx, const char *buf, long len)
+{
+    if (!ctx->kw_cap || len > lex_kw_max_len) return 0;
+
+    char word[lex_kw_max_len];
+
+    for (long i = 0; i < len; ++i) word[i] = lower_c (buf[i]);
+
+    unsigned long mask = ctx->kw_cap - 1;
+
+    for (unsigned long i = hash_keyword (word, len) & mask;
+            ctx->kws[i].id; i = (i + 1) & mask)
+    {
+        if (ctx->kws[i].len == len && !memcmp (ctx->kws[i].word, word, len))
+        {
+            return ctx->kws[i].id;
+        }
+    }
+
+    return 0;
+}
+
+static int
+has_upper (const char *word, long len)
+{
+    for (long i = 0; i < len; ++i)
+    {
+        if (word[i] >= 'A' && word[i] <= 'Z') return 1;
+    }
+
+    return 0;
+}
+
+static void
+push_lowered (lua_State *L, const char *buf, long len)
+{
+    luaL_Buffer B;
+    char *out = luaL_buffinitsize (L, &B, len);
+
+    for (long i = 0; i < len; ++i) out[i] = lower_c (buf[i]);
+
+    luaL_pushresultsize (&B, len);
+}
+
 static void
 push_quoted_lexeme_translated (lua_State *L,
         long len, const char *buf, char q)
@@ -212,987 +647,2199 @@ push_dollar_string_translated (lua_State *L, long len, long marker_len,
     lua_pushlstring (L, buf + marker_len, len - marker_len * 2);
 }
 
-static void
-push_sing_line_comment_translated (lua_State *L, long len, const char *buf)
+static int
+hex_digit (char c)
 {
-    if (len < 2 || buf[0] != '-' || buf[1] != '-')
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+static long
+put_utf8 (char *out, unsigned long code)
+{
+    if (code < 0x80)
     {
-        lua_pushnil (L);
-        return;
+        out[0] = code;
+        return 1;
     }
 
-    lua_pushlstring (L, buf + 2, len - 2);
+    if (code < 0x800)
+    {
+        out[0] = 0xc0 | code >> 6;
+        out[1] = 0x80 | (code & 0x3f);
+        return 2;
+    }
+
+    if (code < 0x10000)
+    {
+        out[0] = 0xe0 | code >> 12;
+        out[1] = 0x80 | (code >> 6 & 0x3f);
+        out[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | code >> 18;
+    out[1] = 0x80 | (code >> 12 & 0x3f);
+    out[2] = 0x80 | (code >> 6 & 0x3f);
+    out[3] = 0x80 | (code & 0x3f);
+    return 4;
 }
 
 static void
-push_mult_line_comment_translated (lua_State *L, long len, const char *buf)
+push_escape_string_translated (lua_State *L, long len, const char *buf)
 {
-    if (len < 4 || buf[0] != '/' || buf[1] != '*' ||
-            buf[len - 2] != '*' || buf[len - 1] != '/')
+    // ``E'...'``: C-style backslash escapes as PostgreSQL has them.
+    // an escape never makes more bytes than it takes
+
+    if (len < 3 || (buf[0] != 'e' && buf[0] != 'E') ||
+            buf[1] != '\'' || buf[len - 1] != '\'')
     {
         lua_pushnil (L);
         return;
     }
 
-    lua_pushlstring (L, buf + 2, len - 4);
-}
-
-static const char *lex_ctx_tname = "lex_ctx";
-
-static int
-lex_make_ctx (lua_State *L)
-{
-    long max_size = luaL_checkinteger (L, 1);
-    struct lex_ctx *ctx = lua_newuserdata (L, sizeof (struct lex_ctx));
+    luaL_Buffer B;
+    char *out = luaL_buffinitsize (L, &B, len);
+    long sz = 0;
+    long l = len - 1;
 
-    *ctx = (struct lex_ctx)
+    for (long i = 2; i < l; ++i)
     {
-        .max_size = max_size,
-    };
+        char c = buf[i];
 
-    luaL_setmetatable (L, lex_ctx_tname);
+        if (c == '\'')
+        {
+            // doubled quote, the lexer has checked it
 
-    return 1;
-}
+            out[sz++] = c;
+            ++i;
+            continue;
+        }
 
-struct lex_feed_ctx
-{
-    lua_State *L;
-    struct lex_ctx *ctx;
-    int not_exists_callback;
-    int trans_more;
-    char stash;
-    char c;
-};
+        if (c != '\\')
+        {
+            out[sz++] = c;
+            continue;
+        }
 
-static void
-yield_lexeme (struct lex_feed_ctx *f)
-{
-    if (f->not_exists_callback) return;
+        if (++i == l) goto invalid;
 
-    lua_pushvalue (f->L, 3);
+        c = buf[i];
 
-    lua_pushinteger (f->L, f->ctx->type);
-    lua_pushinteger (f->L, f->ctx->subtype);
-    lua_createtable (f->L, 0, 3);
-    lua_pushinteger (f->L, f->ctx->lpos);
-    lua_setfield (f->L, -2, "lpos");
-    lua_pushinteger (f->L, f->ctx->lline);
-    lua_setfield (f->L, -2, "lline");
-    lua_pushinteger (f->L, f->ctx->lcol);
-    lua_setfield (f->L, -2, "lcol");
-    lua_pushlstring (f->L, f->ctx->buf, f->ctx->len);
+        switch (c)
+        {
+            case 'b': out[sz++] = '\b'; break;
+            case 'f': out[sz++] = '\f'; break;
+            case 'n': out[sz++] = '\n'; break;
+            case 'r': out[sz++] = '\r'; break;
+            case 't': out[sz++] = '\t'; break;
+
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+            {
+                int code = c - '0';
 
-    switch (f->ctx->subtype)
-    {
-        case lex_subtype_simple_ident:
-            lua_pushlstring (f->L, f->ctx->buf, f->ctx->len);
-            lua_getfield (f->L, -1, "lower");
-            lua_insert (f->L, lua_absindex (f->L, -2));
-            lua_call (f->L, 1, 1);
-            break;
+                for (int k = 1; k < 3 && i + 1 < l &&
+                        buf[i + 1] >= '0' && buf[i + 1] <= '7'; ++k)
+                {
+                    code = code * 8 + (buf[++i] - '0');
+                }
 
-        case lex_subtype_quoted_ident:
-            push_quoted_lexeme_translated (f->L, f->ctx->len, f->ctx->buf, '"');
-            break;
+                // postgresql rejects a zero byte and codes over a byte
 
-        default:
-            if (f->trans_more)
+                if (!code || code > 0xff) goto invalid;
+
+                out[sz++] = code;
+                break;
+            }
+
+            case 'x':
             {
-                switch (f->ctx->subtype)
+                int code = -1;
+
+                for (int k = 0; k < 2 && i + 1 < l &&
+                        hex_digit (buf[i + 1]) >= 0; ++k)
                 {
-                    case lex_subtype_simple_string:
-                        push_quoted_lexeme_translated (
-                                f->L, f->ctx->len, f->ctx->buf, '\'');
-                        break;
+                    code = (code < 0 ? 0 : code * 16) + hex_digit (buf[++i]);
+                }
 
-                    // XXX  unimplemented yet:
-                    //          ``case lex_subtype_escape_string: ...``
+                if (!code) goto invalid; // a zero byte, like the octal one
 
-                    case lex_subtype_dollar_string:
-                        push_dollar_string_translated (f->L, f->ctx->len,
-                                f->ctx->state.dollar_string.marker_len,
-                                f->ctx->buf);
-                        break;
+                if (code < 0) out[sz++] = c; // ``\x`` without digits is ``x``
+                else out[sz++] = code;
+                break;
+            }
 
-                    case lex_subtype_sing_line_comment:
-                        push_sing_line_comment_translated (
-                                f->L, f->ctx->len, f->ctx->buf);
-                        break;
+            case 'u':
+            case 'U':
+            {
+                int digits = c == 'u' ? 4 : 8;
+                unsigned long code = 0;
 
-                    case lex_subtype_mult_line_comment:
-                        push_mult_line_comment_translated (
-                                f->L, f->ctx->len, f->ctx->buf);
-                        break;
+                if (i + digits >= l) goto invalid;
+
+                for (int k = 0; k < digits; ++k)
+                {
+                    int d = hex_digit (buf[++i]);
+
+                    if (d < 0) goto invalid;
 
-                    default:
-                        lua_pushnil (f->L);
+                    code = code * 16 + d;
                 }
+
+                if (!code || code > 0x10ffff ||
+                        (code >= 0xd800 && code <= 0xdfff))
+                {
+                    // surrogate pairs aren't supported
+
+                    goto invalid;
+                }
+
+                sz += put_utf8 (out + sz, code);
+                break;
             }
-            else
-            {
-                lua_pushnil (f->L);
-            }
+
+            default:
+                out[sz++] = c;
+        }
     }
 
-    lua_call (f->L, 5, 0);
+    luaL_pushresultsize (&B, sz);
+    return;
+
+invalid:
+    luaL_pushresultsize (&B, 0);
+    lua_pop (L, 1);
+    lua_pushnil (L);
 }
 
 static void
-finish_lexeme (struct lex_feed_ctx *f)
+push_sing_line_comment_translated (lua_State *L, long len, const char *buf)
 {
-    yield_lexeme (f);
+    if (len < 2 || buf[0] != '-' || buf[1] != '-')
+    {
+        lua_pushnil (L);
+        return;
+    }
 
-    f->ctx->type = lex_type_undefined;
-    f->ctx->subtype = lex_subtype_undefined;
-    f->ctx->len = 0;
+    lua_pushlstring (L, buf + 2, len - 2);
 }
 
 static void
-finish_lexeme_with_state (struct lex_feed_ctx *f)
+push_mult_line_comment_translated (lua_State *L, long len, const char *buf)
 {
-    finish_lexeme (f);
-    f->ctx->state = (union lex_ctx_state) {};
+    if (len < 4 || buf[0] != '/' || buf[1] != '*' ||
+            buf[len - 2] != '*' || buf[len - 1] != '/')
+    {
+        lua_pushnil (L);
+        return;
+    }
+
+    lua_pushlstring (L, buf + 2, len - 4);
 }
 
-static inline int
-undefined_wo_stash (struct lex_feed_ctx *f)
+static void
+push_translated (lua_State *L, int subtype, const char *buf, long len,
+        long aux)
 {
-    switch (f->c)
-    {
-        case 'a' ... 'd':
-        case 'f' ... 't':
-        case 'v' ... 'z':
-        case 'A' ... 'D':
-        case 'F' ... 'T':
-        case 'V' ... 'Z':
-        case '_':
-            // no cases 'e' 'E' 'u' 'U' here, cause of them f->stash behaviour.
-            // no case '0' ... '9' '$' here, cause of starting ident lexeme
-
-            f->ctx->type = lex_type_ident;
-            f->ctx->subtype = lex_subtype_simple_ident;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, f->c);
-            break;
+    // translation of strings and comments, which is made on demand
 
-        case '0' ... '9':
-            f->ctx->type = lex_type_number;
-            f->ctx->subtype = lex_subtype_number;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, f->c);
+    switch (subtype)
+    {
+        case lex_subtype_simple_string:
+            push_quoted_lexeme_translated (L, len, buf, '\'');
             break;
 
-        case '\'':
-            f->ctx->type = lex_type_string;
-            f->ctx->subtype = lex_subtype_simple_string;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, '\'');
+        case lex_subtype_escape_string:
+            push_escape_string_translated (L, len, buf);
             break;
 
-        case '"':
-            f->ctx->type = lex_type_ident;
-            f->ctx->subtype = lex_subtype_quoted_ident;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, '"');
+        case lex_subtype_dollar_string:
+            push_dollar_string_translated (L, len, aux, buf);
             break;
 
-        case '$':
-            f->ctx->type = lex_type_string;
-            f->ctx->subtype = lex_subtype_dollar_string;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, '$');
+        case lex_subtype_sing_line_comment:
+            push_sing_line_comment_translated (L, len, buf);
             break;
 
-        case ',':
-        case ';':
-        case ':':
-        case '(':
-        case ')':
-        case '[':
-        case ']':
-        case '{':
-        case '}':
-            // no case '.' here, cause of its f->stash behaviour
-
-            f->ctx->type = lex_type_symbols;
-            f->ctx->subtype = lex_subtype_special_symbols;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, f->c);
+        case lex_subtype_mult_line_comment:
+            push_mult_line_comment_translated (L, len, buf);
             break;
 
-        case '`':
-        case '~':
-        case '!':
-        case '@':
-        case '#':
-        case '%':
-        case '^':
-        case '&':
-        case '*':
-        case '=':
-        case '|':
-        case '<':
-        case '>':
-        case '?':
-            // no cases '-' '+' '/' here, cause of them f->stash behaviour
-
-            f->ctx->type = lex_type_symbols;
-            f->ctx->subtype = lex_subtype_random_symbols;
-            set_lpos (f->ctx);
-            push_c_to_buf (f->L, f->ctx, f->c);
-            break;
+        default:
+            lua_pushnil (L);
+    }
+}
 
-        case '-':
-        case '+':
-        case '/':
-        case '.':
-        case 'e':
-        case 'E':
-        case 'u':
-        case 'U':
-            f->ctx->stash = f->c;
-            break;
+static void
+push_lexeme (lua_State *L, int type, int subtype,
+        long lpos, long lline, long lcol,
+        const char *buf, long len, long aux, int keywords_idx, int trans_more)
+{
+    // pushes 6 values: type, subtype, location, value, translated_value,
+    // kw_id.
+    // ``aux`` is a keyword id of simple ident, or a marker length of
+    // dollar string. ``keywords_idx`` is stack index of keyword list
 
-        case ' ':
-        case '\t':
-        case '\v':
-        case '\n':
-        case '\r':
+    lua_pushinteger (L, type);
+    lua_pushinteger (L, subtype);
+    lua_createtable (L, 0, 3);
+    lua_pushinteger (L, lpos);
+    lua_setfield (L, -2, "lpos");
+    lua_pushinteger (L, lline);
+    lua_setfield (L, -2, "lline");
+    lua_pushinteger (L, lcol);
+    lua_setfield (L, -2, "lcol");
+    lua_pushlstring (L, buf, len);
+
+    switch (subtype)
+    {
+        case lex_subtype_simple_ident:
+            if (aux) lua_rawgeti (L, keywords_idx, aux);
+            else push_lowered (L, buf, len);
             break;
 
-        case 0:
-            f->ctx->pos = 0;
-            f->ctx->line = 0;
-            f->ctx->col = 0;
-            f->ctx->ppos = 0;
-            f->ctx->pline = 0;
-            f->ctx->pcol = 0;
-            f->ctx->lpos = 0;
-            f->ctx->lline = 0;
-            f->ctx->lcol = 0;
+        case lex_subtype_quoted_ident:
+            push_quoted_lexeme_translated (L, len, buf, '"');
             break;
 
-        case '\\':
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "lexeme type started with \"\\\" "
-                    "is forbidden",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col);
-            __builtin_unreachable ();
-
         default:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unknown lexeme type started with character: "
-                    "%d %c",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col,
-                    (int) f->c, f->c);
-            __builtin_unreachable ();
+            if (trans_more) push_translated (L, subtype, buf, len, aux);
+            else lua_pushnil (L);
     }
 
-    return 0;
+    lua_pushinteger (L, subtype == lex_subtype_simple_ident ? aux : 0);
 }
 
-static inline int
-undefined_with_stash (struct lex_feed_ctx *f)
+static const char *lex_ctx_tname = "lex_ctx";
+
+static int
+lex_make_ctx (lua_State *L)
 {
-    switch (f->stash)
+    long max_size = luaL_checkinteger (L, 1);
+    struct lex_ctx *ctx = lua_newuserdata (L, sizeof (struct lex_ctx));
+
+    *ctx = (struct lex_ctx)
     {
-        case '-':
-        case '+':
-        case '/':
-        case '.':
-            if (f->stash == '-' && f->c == '-')
-            {
-                f->ctx->type = lex_type_comment;
-                f->ctx->subtype = lex_subtype_sing_line_comment;
-                set_plpos (f->ctx);
-                push_str_to_buf (f->L, f->ctx, "--", 2);
-            }
-            else if (f->stash == '/' && f->c == '*')
-            {
-                f->ctx->type = lex_type_comment;
-                f->ctx->subtype = lex_subtype_mult_line_comment;
-                set_plpos (f->ctx);
-                push_str_to_buf (f->L, f->ctx, "/*", 2);
-            }
-            else if ((f->stash == '-' || f->stash == '.') &&
-                    f->c >= '0' && f->c <= '9')
-            {
-                // XXX  we don't support numbers like ``-.123`` yet
+        .max_size = max_size,
+        .level = 1,
+    };
 
-                f->ctx->type = lex_type_number;
-                f->ctx->subtype = lex_subtype_number;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                push_c_to_buf (f->L, f->ctx, f->c);
-            }
-            else if (f->stash == '.')
-            {
-                f->ctx->type = lex_type_symbols;
-                f->ctx->subtype = lex_subtype_special_symbols;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                return 1;
-            }
-            else
-            {
-                f->ctx->type = lex_type_symbols;
-                f->ctx->subtype = lex_subtype_random_symbols;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                return 1;
-            }
-            break;
+    luaL_setmetatable (L, lex_ctx_tname);
 
-        case 'e':
-        case 'E':
-            if (f->c == '\'')
-            {
-                f->ctx->type = lex_type_string;
-                f->ctx->subtype = lex_subtype_escape_string;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                push_c_to_buf (f->L, f->ctx, f->c);
-            }
-            else
-            {
-                f->ctx->type = lex_type_ident;
-                f->ctx->subtype = lex_subtype_simple_ident;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                return 1;
-            }
-            break;
+    return 1;
+}
 
-        case 'u':
-        case 'U':
-            if (f->c == '&')
-            {
-                luaL_error (f->L,
-                        "pos(%I) line(%I) col(%I): "
-                        "lexeme type started with \"u&\" "
-                        "is not supported yet",
-                        (lua_Integer) f->ctx->pos,
-                        (lua_Integer) f->ctx->line,
-                        (lua_Integer) f->ctx->col);
-                __builtin_unreachable ();
-            }
-            else
-            {
-                f->ctx->type = lex_type_ident;
-                f->ctx->subtype = lex_subtype_simple_ident;
-                set_plpos (f->ctx);
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                return 1;
-            }
-            break;
+static const char *lex_batch_tname = "lex_batch";
 
-        default:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unknown lexeme type started with characters: "
-                    "%d %d %c %c",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col,
-                    (int) f->stash, (int) f->c, f->stash, f->c);
-            __builtin_unreachable ();
+static void *
+realloc_batch_column (void *column, long cap, size_t item_size)
+{
+    void *new_column = realloc (column, cap * item_size);
+
+    if (__builtin_expect (!new_column, 0))
+    {
+        fprintf (stderr,
+                "memory reallocation error for lex_batch column\n");
+        abort ();
     }
 
-    return 0;
+    return new_column;
 }
 
-static inline int
-simple_ident (struct lex_feed_ctx *f)
+static void
+grow_batch (struct lex_batch *batch)
 {
-    switch (f->c)
+    long cap = batch->cap ? batch->cap * 2 : lex_batch_init_cap;
+
+    batch->type = realloc_batch_column (batch->type, cap,
+            sizeof (*batch->type));
+    batch->subtype = realloc_batch_column (batch->subtype, cap,
+            sizeof (*batch->subtype));
+    batch->lpos = realloc_batch_column (batch->lpos, cap,
+            sizeof (*batch->lpos));
+    batch->lline = realloc_batch_column (batch->lline, cap,
+            sizeof (*batch->lline));
+    batch->lcol = realloc_batch_column (batch->lcol, cap,
+            sizeof (*batch->lcol));
+    batch->voff = realloc_batch_column (batch->voff, cap,
+            sizeof (*batch->voff));
+    batch->vlen = realloc_batch_column (batch->vlen, cap,
+            sizeof (*batch->vlen));
+    batch->aux = realloc_batch_column (batch->aux, cap,
+            sizeof (*batch->aux));
+    batch->level = realloc_batch_column (batch->level, cap,
+            sizeof (*batch->level));
+
+    batch->cap = cap;
+}
+
+static long
+push_to_batch_extra (struct lex_batch *batch, const char *add, long add_size)
+{
+    long need_size = batch->extra_len + add_size;
+
+    if (need_size > batch->extra_size)
     {
-        case 'a' ... 'z':
-        case 'A' ... 'Z':
-        case '_':
-        case '0' ... '9':
-        case '$':
-            push_c_to_buf (f->L, f->ctx, f->c);
-            break;
+        long size = batch->extra_size ? batch->extra_size : lex_buf_init_size;
 
-        default:
-            finish_lexeme (f);
-            return 1;
+        while (need_size > size) size *= 2;
+
+        char *extra = realloc (batch->extra, size);
+
+        if (__builtin_expect (!extra, 0))
+        {
+            fprintf (stderr,
+                    "memory reallocation error for lex_batch extra buffer\n");
+            abort ();
+        }
+
+        batch->extra = extra;
+        batch->extra_size = size;
     }
 
-    return 0;
+    long offset = batch->extra_len;
+
+    memcpy (batch->extra + offset, add, add_size);
+    batch->extra_len = need_size;
+
+    return offset;
 }
 
-static inline int
-quoted_ident_wo_stash (struct lex_feed_ctx *f)
+static long
+lexeme_aux (struct lex_feed_ctx *f)
 {
-    switch (f->c)
+    switch (f->ctx->subtype)
     {
-        case '"':
-            if (__builtin_expect (!f->ctx->len, 0))
-            {
-                fprintf (stderr, "unexpected program flow\n");
-                abort ();
-            }
-
-            f->ctx->stash = f->c;
-            break;
+        case lex_subtype_simple_ident:
+            return find_keyword (f->ctx, lexeme_buf (f), f->ctx->len);
 
-        case 0:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unterminated lexeme: quoted_ident",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col);
-            __builtin_unreachable ();
+        case lex_subtype_dollar_string:
+            return f->ctx->state.dollar_string.marker_len;
 
         default:
-            push_c_to_buf (f->L, f->ctx, f->c);
+            return 0;
     }
-
-    return 0;
 }
 
-static inline int
-quoted_ident_with_stash (struct lex_feed_ctx *f)
+static void
+add_stmt_to_batch (struct lex_feed_ctx *f, long last_i)
 {
-    if (__builtin_expect (f->stash != '"', 0)) {
-        fprintf (stderr, "unexpected program flow\n");
-        abort ();
-    }
+    struct lex_batch *batch = f->batch;
+    struct lex_ctx *ctx = f->ctx;
 
-    if (f->c == '"')
+    if (batch->stmt_count == batch->stmt_cap)
     {
-        push_str_to_buf (f->L, f->ctx, "\"\"", 2);
+        long cap = batch->stmt_cap ? batch->stmt_cap * 2 : lex_batch_init_cap;
+
+        batch->stmts = realloc_batch_column (batch->stmts, cap,
+                sizeof (*batch->stmts));
+        batch->stmt_cap = cap;
     }
-    else
+
+    struct lex_stmt *stmt = &batch->stmts[batch->stmt_count++];
+
+    *stmt = (struct lex_stmt)
     {
-        push_c_to_buf (f->L, f->ctx, f->stash);
-        finish_lexeme (f);
-        return 1;
-    }
+        .begin_pos = ctx->stmt_lpos,
+        .end_pos = ctx->lpos + ctx->len,
+        .last_i = last_i,
+        .nkws = ctx->stmt_nkws,
+        .lline = ctx->stmt_lline,
+        .lcol = ctx->stmt_lcol,
+        .obj = -1,
+        .cap_off = batch->cap_count,
+    };
 
-    return 0;
-}
+    memcpy (stmt->kws, ctx->stmt_kws, sizeof (stmt->kws));
 
-static inline int
-number_wo_stash (struct lex_feed_ctx *f)
+    if (!ctx->match_prog) return;
+
+    // the matched object type with its values, they're copied since
+    // the statement could begin in one of previous blocks
+
+    const struct pt_match_run *run = ctx->match_run;
+
+    stmt->obj = run->obj;
+    stmt->obj_priority = run->obj_priority;
+    stmt->dead_end_pos = run->dead_end_pos;
+    stmt->lexemes = run->step;
+    stmt->peak_states = run->peak_states;
+
+    if (ctx->match_profile)
+    {
+        stmt->elapsed = (double) (clock () - ctx->stmt_clock) / CLOCKS_PER_SEC;
+    }
+
+    if (run->obj == -1) return;
+
+    for (int key = 0; key < ctx->match_prog->key_count; ++key)
+    {
+        if (!run->obj_caps[key]) continue;
+
+        const struct pt_match_cap *cap = &run->caps[run->obj_caps[key] - 1];
+
+        if (batch->cap_count == batch->cap_cap)
+        {
+            long cap_cap = batch->cap_cap ? batch->cap_cap * 2 : 64;
+
+            batch->caps = realloc_batch_column (batch->caps, cap_cap,
+                    sizeof (*batch->caps));
+            batch->cap_cap = cap_cap;
+        }
+
+        if (batch->cap_bytes_len + cap->len > batch->cap_bytes_size)
+        {
+            long size = batch->cap_bytes_size ? batch->cap_bytes_size : 1024;
+
+            while (batch->cap_bytes_len + cap->len > size) size *= 2;
+
+            batch->cap_bytes = realloc_batch_column (batch->cap_bytes, size, 1);
+            batch->cap_bytes_size = size;
+        }
+
+        memcpy (batch->cap_bytes + batch->cap_bytes_len,
+                run->bytes + cap->off, cap->len);
+        batch->caps[batch->cap_count++] = (struct lex_stmt_cap)
+        {
+            .key = key,
+            .op = cap->op,
+            .subtype = cap->subtype,
+            .aux = cap->aux,
+            .off = batch->cap_bytes_len,
+            .len = cap->len,
+        };
+        batch->cap_bytes_len += cap->len;
+        ++stmt->cap_count;
+    }
+}
+
+static void
+keep_pending_stmt (struct lex_feed_ctx *f)
 {
-    switch (f->c)
+    // the final mark of stream is inside of a statement
+
+    struct lex_ctx *ctx = f->ctx;
+
+    f->batch->has_pending = 1;
+    f->batch->pending = (struct lex_stmt)
     {
-        case '-':
-        case '+':
-            if (f->ctx->len &&
-                    f->ctx->len != f->ctx->state.number.e_len)
-            {
-                finish_lexeme_with_state (f);
-                return 1;
-            }
-            else
-            {
-                f->ctx->stash = f->c;
-                break;
-            }
+        .begin_pos = ctx->stmt_lpos,
+        .lline = ctx->stmt_lline,
+        .lcol = ctx->stmt_lcol,
+        .obj = -1,
+        .dead_end_pos = ctx->match_prog ? ctx->match_run->dead_end_pos : 0,
+    };
+}
 
-        case '0' ... '9':
-            push_c_to_buf (f->L, f->ctx, f->c);
-            break;
+static int
+match_kind (int subtype)
+{
+    switch (subtype)
+    {
+        case lex_subtype_simple_ident:
+            return pt_match_kind_simple_ident;
 
-        case 'e':
-        case 'E':
-            if (f->ctx->state.number.e_len)
-            {
-                finish_lexeme_with_state (f);
-                return 1;
-            }
-            else
-            {
-                f->ctx->stash = f->c;
-                break;
-            }
+        case lex_subtype_quoted_ident:
+            return pt_match_kind_quoted_ident;
 
-        case '.':
-            if (f->ctx->state.number.has_dot)
-            {
-                finish_lexeme_with_state (f);
-                return 1;
-            }
-            else
-            {
-                f->ctx->stash = f->c;
-                break;
-            }
+        case lex_subtype_simple_string:
+        case lex_subtype_escape_string:
+        case lex_subtype_dollar_string:
+            return pt_match_kind_string;
+
+        case lex_subtype_special_symbols:
+            return pt_match_kind_special_symbols;
+
+        case lex_subtype_random_symbols:
+            return pt_match_kind_random_symbols;
 
         default:
-            finish_lexeme_with_state (f);
-            return 1;
+            return pt_match_kind_other;
+    }
+}
+
+static void
+match_lexeme (struct lex_feed_ctx *f, long level, long aux, int is_end)
+{
+    struct lex_ctx *ctx = f->ctx;
+    const struct pt_match_prog *prog = ctx->match_prog;
+    struct pt_match_run *run = ctx->match_run;
+    struct pt_match_lexeme lx =
+    {
+        .kind = match_kind (ctx->subtype),
+        .subtype = ctx->subtype,
+        .level = level,
+        .kw_id = ctx->subtype == lex_subtype_simple_ident ? aux : 0,
+        .aux = aux,
+        .pos = ctx->lpos + ctx->len,
+        .buf = lexeme_buf (f),
+        .len = ctx->len,
+    };
+
+    enum pt_match_result result = pt_match_step (run, &lx, is_end);
+
+    if (__builtin_expect (result == pt_match_ok, 1)) return;
+
+    if (result == pt_match_too_many)
+    {
+        const struct pt_match_symbol *a = &prog->obj_types[run->too_many_obj];
+
+        luaL_error (f->L, "pos(%I) line(%I) col(%I): too many pattern states "
+                "(more than %I), obj_type: %s",
+                (lua_Integer) ctx->stmt_lpos, (lua_Integer) ctx->stmt_lline,
+                (lua_Integer) ctx->stmt_lcol, (lua_Integer) run->max_states,
+                prog->strings + a->off);
     }
 
-    return 0;
+    const struct pt_match_symbol *a = &prog->obj_types[run->obj];
+    const struct pt_match_symbol *b = &prog->obj_types[run->ambiguous_obj];
+
+    luaL_error (f->L, "pos(%I) line(%I) col(%I): ambiguous obj_type: "
+            "%s pri(%I) or %s pri(%I)",
+            (lua_Integer) ctx->stmt_lpos, (lua_Integer) ctx->stmt_lline,
+            (lua_Integer) ctx->stmt_lcol,
+            prog->strings + a->off, (lua_Integer) run->obj_priority,
+            prog->strings + b->off, (lua_Integer) run->ambiguous_priority);
 }
 
-static inline int
-number_with_stash (struct lex_feed_ctx *f)
+static long
+track_statement (struct lex_feed_ctx *f, long i, long aux)
 {
-    switch (f->stash)
+    // parentheses levels and top-level statements, the same as
+    // split_to_chunks finds them. returns the lexeme's level: ``(`` and
+    // ``)`` are at the outer level
+
+    struct lex_ctx *ctx = f->ctx;
+    char symbol = ctx->subtype == lex_subtype_special_symbols &&
+            ctx->len == 1 ? lexeme_buf (f)[0] : 0;
+
+    if (symbol == ')' && --ctx->level < 1)
     {
-        case '-':
-        case '+':
-            switch (f->c)
-            {
-                case '.':
-                    if (f->ctx->state.number.e_len)
-                    {
-                        finish_lexeme_with_state (f);
-                        return 2;
-                    }
-                    __attribute__ ((fallthrough));
-                case '0' ... '9':
-                    push_c_to_buf (f->L, f->ctx, f->stash);
-                    push_c_to_buf (f->L, f->ctx, f->c);
-                    break;
+        // split_to_chunks doesn't look at lexemes when they are matched
+        // here, so it's checked here too. otherwise the lexeme is kept for
+        // skipping statements, split_to_chunks raises the error on it
 
-                default:
-                    finish_lexeme_with_state (f);
-                    return 2;
-            }
-            break;
+        if (ctx->match_prog)
+        {
+            luaL_error (f->L, "pos(%I) line(%I) col(%I): level < 1",
+                    (lua_Integer) ctx->lpos, (lua_Integer) ctx->lline,
+                    (lua_Integer) ctx->lcol);
+        }
 
-        case '.':
-            if (f->c == '.')
-            {
-                finish_lexeme_with_state (f);
-                return 2;
-            }
-            else
+        if (!f->batch->level_error_i) f->batch->level_error_i = i + 1;
+    }
+
+    long level = ctx->level;
+
+    if (ctx->type != lex_type_comment)
+    {
+        int is_end = symbol == ';' && level == 1;
+
+        if (!ctx->in_stmt)
+        {
+            ctx->in_stmt = 1;
+            ctx->stmt_lpos = ctx->lpos;
+            ctx->stmt_lline = ctx->lline;
+            ctx->stmt_lcol = ctx->lcol;
+            ctx->stmt_nkws = 0;
+
+            if (ctx->match_prog)
             {
-                push_c_to_buf (f->L, f->ctx, f->stash);
-                f->ctx->state.number.has_dot = 1;
-                return 1;
+                pt_match_begin (ctx->match_run, ctx->match_prog);
+
+                if (ctx->match_profile) ctx->stmt_clock = clock ();
             }
+        }
 
-        case 'e':
-        case 'E':
-            switch (f->c)
-            {
-                case '-':
-                case '+':
-                case '0' ... '9':
-                    push_c_to_buf (f->L, f->ctx, f->stash);
-                    f->ctx->state.number.e_len = f->ctx->len;
-                    f->ctx->state.number.has_dot = 1;
+        if (level == 1 && ctx->stmt_nkws < lex_stmt_max_kws)
+        {
+            ctx->stmt_kws[ctx->stmt_nkws++] =
+                    ctx->subtype == lex_subtype_simple_ident ? aux : 0;
+        }
 
-                    if (f->c == '-' || f->c == '+')
-                    {
-                        return 1;
-                    }
-                    else
-                    {
-                        push_c_to_buf (f->L, f->ctx, f->c);
-                        break;
-                    }
+        if (ctx->match_prog) match_lexeme (f, level, aux, is_end);
 
-                default:
-                    finish_lexeme_with_state (f);
-                    return 2;
-            }
-            break;
+        if (is_end)
+        {
+            add_stmt_to_batch (f, i);
+            ctx->in_stmt = 0;
+        }
+    }
 
-        default:
-            fprintf (stderr, "unexpected program flow\n");
-            abort ();
+    if (symbol == '(') ++ctx->level;
+
+    return level;
+}
+
+static void
+add_to_batch (struct lex_feed_ctx *f)
+{
+    struct lex_batch *batch = f->batch;
+    struct lex_ctx *ctx = f->ctx;
+
+    if (batch->count == batch->cap) grow_batch (batch);
+
+    long i = batch->count;
+
+    batch->type[i] = ctx->type;
+    batch->subtype[i] = ctx->subtype;
+    batch->lpos[i] = ctx->lpos;
+    batch->lline[i] = ctx->lline;
+    batch->lcol[i] = ctx->lcol;
+    batch->vlen[i] = ctx->len;
+    batch->aux[i] = lexeme_aux (f);
+    batch->level[i] = track_statement (f, i, batch->aux[i]);
+
+    if (f->lexeme)
+    {
+        batch->voff[i] = f->lexeme - f->input;
     }
+    else
+    {
+        // the lexeme was started in one of previous input blocks
 
-    return 0;
+        batch->voff[i] = -1 - push_to_batch_extra (batch, ctx->buf, ctx->len);
+    }
+
+    batch->count = i + 1;
+}
+
+static void
+yield_lexeme (struct lex_feed_ctx *f)
+{
+    if (f->batch)
+    {
+        add_to_batch (f);
+        return;
+    }
+
+    lua_pushvalue (f->L, 3);
+    push_lexeme (f->L, f->ctx->type, f->ctx->subtype,
+            f->ctx->lpos, f->ctx->lline, f->ctx->lcol,
+            lexeme_buf (f), f->ctx->len, lexeme_aux (f),
+            f->keywords_idx, f->trans_more);
+    lua_call (f->L, 6, 0);
+}
+
+static void
+finish_lexeme (struct lex_feed_ctx *f)
+{
+    yield_lexeme (f);
+
+    f->ctx->type = lex_type_undefined;
+    f->ctx->subtype = lex_subtype_undefined;
+    f->ctx->len = 0;
+    f->lexeme = 0;
+}
+
+static void
+finish_lexeme_with_state (struct lex_feed_ctx *f)
+{
+    finish_lexeme (f);
+    f->ctx->state = (union lex_ctx_state) {};
 }
 
 static inline int
-simple_string_wo_stash (struct lex_feed_ctx *f)
+undefined_wo_stash (struct lex_feed_ctx *f)
 {
-    switch (f->c)
+    const struct lex_start *start =
+            &lex_starts[lex_char_classes[(unsigned char) f->c]];
+
+    switch (start->action)
     {
-        case '\'':
-            if (__builtin_expect (!f->ctx->len, 0))
-            {
-                fprintf (stderr, "unexpected program flow\n");
-                abort ();
-            }
+        case lex_start_lexeme:
+            f->ctx->type = start->type;
+            f->ctx->subtype = start->subtype;
+            set_lpos (f);
+            push_c_to_buf (f, f->c);
+            break;
+
+        case lex_start_stash:
+            // chars like '-' or 'e' start different lexemes depending on
+            // the next char
 
             f->ctx->stash = f->c;
             break;
 
-        case 0:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unterminated lexeme: simple_string",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col);
+        case lex_start_skip:
+            break;
+
+        case lex_start_reset:
+            // the next char is the first one of a new stream
+
+            if (f->batch && f->ctx->in_stmt) keep_pending_stmt (f);
+
+            f->ctx->pos = -1 - f->input_i;
+            f->ctx->nl_pos = 0;
+            f->ctx->nl_count = 0;
+            f->ctx->nl_last = 0;
+            f->ctx->level = 1;
+            f->ctx->in_stmt = 0;
+            f->ctx->lpos = 0;
+            f->ctx->lline = 0;
+            f->ctx->lcol = 0;
+            break;
+
+        case lex_start_backslash:
+            lex_error (f, "lexeme type started with \"\\\" "
+                    "is forbidden");
             __builtin_unreachable ();
 
         default:
-            push_c_to_buf (f->L, f->ctx, f->c);
+            lex_error (f, "unknown lexeme type started with character: "
+                    "%d %c",
+                    (int) f->c, f->c);
+            __builtin_unreachable ();
     }
 
     return 0;
 }
 
 static inline int
-escape_string_wo_stash (struct lex_feed_ctx *f)
+undefined_with_stash (struct lex_feed_ctx *f)
 {
-    switch (f->c)
+    switch (f->stash)
     {
-        case '\'':
-            if (__builtin_expect (f->ctx->len < 2, 0))
+        case '-':
+        case '+':
+        case '/':
+        case '.':
+            if (f->stash == '-' && f->c == '-')
             {
-                fprintf (stderr, "unexpected program flow\n");
-                abort ();
+                f->ctx->type = lex_type_comment;
+                f->ctx->subtype = lex_subtype_sing_line_comment;
+                set_plpos (f);
+                push_str_to_buf (f, "--", 2);
             }
+            else if (f->stash == '/' && f->c == '*')
+            {
+                f->ctx->type = lex_type_comment;
+                f->ctx->subtype = lex_subtype_mult_line_comment;
+                set_plpos (f);
+                push_str_to_buf (f, "/*", 2);
+            }
+            else if ((f->stash == '-' || f->stash == '.') &&
+                    f->c >= '0' && f->c <= '9')
+            {
+                // XXX  we don't support numbers like ``-.123`` yet
+
+                f->ctx->type = lex_type_number;
+                f->ctx->subtype = lex_subtype_number;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                push_c_to_buf (f, f->c);
+            }
+            else if (f->stash == '.')
+            {
+                f->ctx->type = lex_type_symbols;
+                f->ctx->subtype = lex_subtype_special_symbols;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                return 1;
+            }
+            else
+            {
+                f->ctx->type = lex_type_symbols;
+                f->ctx->subtype = lex_subtype_random_symbols;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                return 1;
+            }
+            break;
+
+        case 'e':
+        case 'E':
+            if (f->c == '\'')
+            {
+                f->ctx->type = lex_type_string;
+                f->ctx->subtype = lex_subtype_escape_string;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                push_c_to_buf (f, f->c);
+            }
+            else
+            {
+                f->ctx->type = lex_type_ident;
+                f->ctx->subtype = lex_subtype_simple_ident;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                return 1;
+            }
+            break;
+
+        case 'u':
+        case 'U':
+            if (f->c == '&')
+            {
+                lex_error (f, "lexeme type started with \"u&\" "
+                        "is not supported yet");
+                __builtin_unreachable ();
+            }
+            else
+            {
+                f->ctx->type = lex_type_ident;
+                f->ctx->subtype = lex_subtype_simple_ident;
+                set_plpos (f);
+                push_c_to_buf (f, f->stash);
+                return 1;
+            }
+            break;
+
+        default:
+            lex_error (f, "unknown lexeme type started with characters: "
+                    "%d %d %c %c",
+                    (int) f->stash, (int) f->c, f->stash, f->c);
+            __builtin_unreachable ();
+    }
+
+    return 0;
+}
+
+static inline int
+kept_char (struct lex_feed_ctx *f)
+{
+    // for subtypes which only keep chars of some classes: the char goes
+    // to the lexeme, or any other char finishes it
+
+    if (lex_keeps[f->ctx->subtype][lex_char_classes[(unsigned char) f->c]])
+    {
+        push_c_to_buf (f, f->c);
+    }
+    else
+    {
+        finish_lexeme (f);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline int
+quoted_ident_wo_stash (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '"':
+            if (__builtin_expect (!f->ctx->len, 0))
+            {
+                fprintf (stderr, "unexpected program flow\n");
+                abort ();
+            }
+
+            f->ctx->stash = f->c;
+            break;
+
+        case 0:
+            lex_error (f, "unterminated lexeme: quoted_ident");
+            __builtin_unreachable ();
+
+        default:
+            push_c_to_buf (f, f->c);
+    }
+
+    return 0;
+}
+
+static inline int
+quoted_ident_with_stash (struct lex_feed_ctx *f)
+{
+    if (__builtin_expect (f->stash != '"', 0)) {
+        fprintf (stderr, "unexpected program flow\n");
+        abort ();
+    }
+
+    if (f->c == '"')
+    {
+        push_str_to_buf (f, "\"\"", 2);
+    }
+    else
+    {
+        push_c_to_buf (f, f->stash);
+        finish_lexeme (f);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline int
+number_wo_stash (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '-':
+        case '+':
+            if (f->ctx->len &&
+                    f->ctx->len != f->ctx->state.number.e_len)
+            {
+                finish_lexeme_with_state (f);
+                return 1;
+            }
+            else
+            {
+                f->ctx->stash = f->c;
+                break;
+            }
+
+        case '0' ... '9':
+            push_c_to_buf (f, f->c);
+            break;
+
+        case 'e':
+        case 'E':
+            if (f->ctx->state.number.e_len)
+            {
+                finish_lexeme_with_state (f);
+                return 1;
+            }
+            else
+            {
+                f->ctx->stash = f->c;
+                break;
+            }
+
+        case '.':
+            if (f->ctx->state.number.has_dot)
+            {
+                finish_lexeme_with_state (f);
+                return 1;
+            }
+            else
+            {
+                f->ctx->stash = f->c;
+                break;
+            }
+
+        default:
+            finish_lexeme_with_state (f);
+            return 1;
+    }
+
+    return 0;
+}
+
+static inline int
+number_with_stash (struct lex_feed_ctx *f)
+{
+    switch (f->stash)
+    {
+        case '-':
+        case '+':
+            switch (f->c)
+            {
+                case '.':
+                    if (f->ctx->state.number.e_len)
+                    {
+                        finish_lexeme_with_state (f);
+                        return 2;
+                    }
+                    __attribute__ ((fallthrough));
+                case '0' ... '9':
+                    push_c_to_buf (f, f->stash);
+                    push_c_to_buf (f, f->c);
+                    break;
+
+                default:
+                    finish_lexeme_with_state (f);
+                    return 2;
+            }
+            break;
+
+        case '.':
+            if (f->c == '.')
+            {
+                finish_lexeme_with_state (f);
+                return 2;
+            }
+            else
+            {
+                push_c_to_buf (f, f->stash);
+                f->ctx->state.number.has_dot = 1;
+                return 1;
+            }
+
+        case 'e':
+        case 'E':
+            switch (f->c)
+            {
+                case '-':
+                case '+':
+                case '0' ... '9':
+                    push_c_to_buf (f, f->stash);
+                    f->ctx->state.number.e_len = f->ctx->len;
+                    f->ctx->state.number.has_dot = 1;
+
+                    if (f->c == '-' || f->c == '+')
+                    {
+                        return 1;
+                    }
+                    else
+                    {
+                        push_c_to_buf (f, f->c);
+                        break;
+                    }
+
+                default:
+                    finish_lexeme_with_state (f);
+                    return 2;
+            }
+            break;
+
+        default:
+            fprintf (stderr, "unexpected program flow\n");
+            abort ();
+    }
+
+    return 0;
+}
+
+static inline int
+simple_string_wo_stash (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '\'':
+            if (__builtin_expect (!f->ctx->len, 0))
+            {
+                fprintf (stderr, "unexpected program flow\n");
+                abort ();
+            }
+
+            f->ctx->stash = f->c;
+            break;
+
+        case 0:
+            lex_error (f, "unterminated lexeme: simple_string");
+            __builtin_unreachable ();
+
+        default:
+            push_c_to_buf (f, f->c);
+    }
+
+    return 0;
+}
+
+static int
+is_escaped (struct lex_feed_ctx *f)
+{
+    // is the current char after an odd number of backslashes? they are
+    // already in the lexeme, the span copies them along with other chars
+
+    const char *buf = lexeme_buf (f);
+    long i = f->ctx->len;
+
+    while (i > 2 && buf[i - 1] == '\\') --i;
+
+    return (f->ctx->len - i) % 2;
+}
+
+static inline int
+escape_string_wo_stash (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '\'':
+            if (__builtin_expect (f->ctx->len < 2, 0))
+            {
+                fprintf (stderr, "unexpected program flow\n");
+                abort ();
+            }
+
+            if (is_escaped (f))
+            {
+                push_c_to_buf (f, f->c);
+                break;
+            }
+
+            f->ctx->stash = f->c;
+            break;
+
+        case 0:
+            lex_error (f, "unterminated lexeme: escape_string");
+            __builtin_unreachable ();
+
+        default:
+            push_c_to_buf (f, f->c);
+    }
+
+    return 0;
+}
+
+static inline int
+simple_or_escape_string_with_stash (struct lex_feed_ctx *f)
+{
+    if (__builtin_expect (f->stash != '\'', 0)) {
+        fprintf (stderr, "unexpected program flow\n");
+        abort ();
+    }
+
+    if (f->c == '\'')
+    {
+        push_str_to_buf (f, "''", 2);
+    }
+    else
+    {
+        push_c_to_buf (f, f->stash);
+        finish_lexeme (f);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline int
+dollar_string (struct lex_feed_ctx *f)
+{
+    if (__builtin_expect (f->c == 0, 0))
+    {
+        lex_error (f, "unterminated lexeme: dollar_string ");
+        __builtin_unreachable ();
+    }
+
+    push_c_to_buf (f, f->c);
+
+    if (f->c != '$')
+    {
+        return 0;
+    }
+
+    long len = f->ctx->len;
+    long marker_len = f->ctx->state.dollar_string.marker_len;
+    const char *buf = lexeme_buf (f);
+
+    if (!marker_len)
+    {
+        if (__builtin_expect (len < 2, 0))
+        {
+            fprintf (stderr, "unexpected program flow\n");
+            abort ();
+        }
+
+        f->ctx->state.dollar_string.marker_len = len;
+    }
+    else if (len >= marker_len * 2 &&
+            !memcmp (buf + len - marker_len, buf, marker_len))
+    {
+        finish_lexeme_with_state (f);
+    }
+
+    return 0;
+}
+
+static inline int
+special_symbols (struct lex_feed_ctx *f)
+{
+    if (__builtin_expect (!f->ctx->len, 0))
+    {
+        fprintf (stderr, "unexpected program flow\n");
+        abort ();
+    }
+
+    if (f->ctx->len == 1 && (f->c == '.' || f->c == ':') &&
+                lexeme_buf (f)[0] == f->c)
+    {
+        push_c_to_buf (f, f->c);
+        finish_lexeme (f);
+    }
+    else
+    {
+        finish_lexeme (f);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline int
+sing_line_comment (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '\n':
+        case 0:
+            finish_lexeme (f);
+            return 1;
+
+        default:
+            push_c_to_buf (f, f->c);
+    }
+
+    return 0;
+}
+
+static inline int
+mult_line_comment_wo_stash (struct lex_feed_ctx *f)
+{
+    switch (f->c)
+    {
+        case '*':
+            if (__builtin_expect (f->ctx->len < 2, 0))
+            {
+                fprintf (stderr, "unexpected program flow\n");
+                abort ();
+            }
+
+            f->ctx->stash = f->c;
+            break;
+
+        case 0:
+            lex_error (f, "unterminated lexeme: mult_line_comment");
+            __builtin_unreachable ();
+
+        default:
+            push_c_to_buf (f, f->c);
+    }
+
+    return 0;
+}
+
+static inline int
+mult_line_comment_with_stash (struct lex_feed_ctx *f)
+{
+    if (__builtin_expect (f->stash != '*', 0)) {
+        fprintf (stderr, "unexpected program flow\n");
+        abort ();
+    }
+
+    if (f->c == '/')
+    {
+        push_str_to_buf (f, "*/", 2);
+        finish_lexeme (f);
+    }
+    else
+    {
+        push_c_to_buf (f, f->stash);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+lex_feed (lua_State *L)
+{
+    struct lex_feed_ctx f = {
+        .L = L,
+        .ctx = luaL_checkudata (L, 1, lex_ctx_tname),
+        .trans_more = lua_toboolean (L, 4), // arg: translate more?
+    };
+    size_t input_len = 0;
+    const char *input = lua_tolstring (L, 2, &input_len);
+    struct os_ext_map *map = luaL_testudata (L, 2, OS_EXT_MAP_TNAME);
+    long input_off = 0;
+    const int jmps[] = {0, &&retry_c - &&retry_c, &&retry_stash - &&retry_c};
+    int jmp;
+
+    if (map)
+    {
+        // lexing directly from the mapped file: the input block is
+        // the next part of the map (arg: block size), the cursor moves
+        // over it
+
+        luaL_argcheck (L, map->fd != -1, 2, "closed map");
+
+        long block_size = luaL_optinteger (L, 5, map->size - map->pos);
+
+        luaL_argcheck (L, block_size > 0, 5, "block size must be positive");
+
+        input_off = map->pos;
+        input = map->data + input_off;
+        input_len = map->size - input_off;
+
+        if (input_len > (size_t) block_size) input_len = block_size;
+
+        map->pos += input_len;
+    }
+
+    lua_settop (L, 5);
+    lua_getuservalue (L, 1);
+    f.keywords_idx = lua_gettop (L);
+
+    if (lua_isnil (L, 3)) // arg: callback function
+    {
+        // without callback, lexemes are returned as a batch.
+        // the batch refers to input block and keyword list,
+        // so it keeps them alive
+
+        f.batch = lua_newuserdata (L, sizeof (struct lex_batch));
+
+        *f.batch = (struct lex_batch)
+        {
+            .trans_more = f.trans_more,
+            .input_off = input_off,
+        };
+
+        luaL_setmetatable (L, lex_batch_tname);
+        lua_createtable (L, 2, 0);
+        lua_pushvalue (L, 2);
+        lua_rawseti (L, -2, 1);
+        lua_pushvalue (L, f.keywords_idx);
+        lua_rawseti (L, -2, 2);
+        lua_setuservalue (L, -2);
+    }
+
+    if (__builtin_expect (!input_len, 0))
+    {
+        // the final mark for flushing rest of buffer.
+        // it should not be counted in position counters
+
+        input = "\0";
+        input_len = 1;
+    }
+
+    f.input = input;
+
+    for (f.input_i = 0; f.input_i < input_len; ++f.input_i)
+    {
+        if (!f.ctx->stash)
+        {
+            // fast paths: taking a run of chars at once, when the current
+            // subtype doesn't have to look at each of them
+
+            size_t n = 0;
+
+            if (lex_span_stops[f.ctx->subtype])
+            {
+                // bulk copying the lexeme's body up to the next char which
+                // its handler has to look at
+
+                n = scan_span (input + f.input_i, input_len - f.input_i,
+                        lex_span_stops[f.ctx->subtype]);
+            }
+            else
+            {
+                // table-driven: chars which the subtype just keeps, like
+                // digits of a number or spaces between lexemes
+
+                const unsigned char *keeps = lex_keeps[f.ctx->subtype];
+
+                while (f.input_i + n < input_len && keeps[lex_char_classes[
+                        (unsigned char) input[f.input_i + n]]])
+                {
+                    ++n;
+                }
+            }
+
+            if (n)
+            {
+                if (f.ctx->subtype != lex_subtype_undefined)
+                {
+                    push_str_to_buf (&f, input + f.input_i, n);
+                }
+
+                f.input_i += n;
+
+                if (f.input_i == input_len) break;
+            }
+        }
+
+        // only the offset in block is tracked for each char.
+        // positions, lines and columns are found when they are needed
+
+        f.c = input[f.input_i];
+
+retry_c:
+        f.stash = f.ctx->stash;
+        f.ctx->stash = 0;
+
+retry_stash:
+        jmp = 0;
+
+        switch (f.ctx->subtype)
+        {
+            case lex_subtype_undefined:
+                if (f.stash) jmp = undefined_with_stash (&f);
+                else jmp = undefined_wo_stash (&f);
+                break;
+
+            case lex_subtype_simple_ident:
+            case lex_subtype_random_symbols:
+                jmp = kept_char (&f);
+                break;
+
+            case lex_subtype_quoted_ident:
+                if (f.stash) jmp = quoted_ident_with_stash (&f);
+                else jmp = quoted_ident_wo_stash (&f);
+                break;
+
+            case lex_subtype_number:
+                if (f.stash) jmp = number_with_stash (&f);
+                else jmp = number_wo_stash (&f);
+                break;
+
+            case lex_subtype_simple_string:
+                if (f.stash) jmp = simple_or_escape_string_with_stash (&f);
+                else jmp = simple_string_wo_stash (&f);
+                break;
+
+            case lex_subtype_escape_string:
+                if (f.stash) jmp = simple_or_escape_string_with_stash (&f);
+                else jmp = escape_string_wo_stash (&f);
+                break;
+
+            case lex_subtype_dollar_string:
+                jmp = dollar_string (&f);
+                break;
+
+            case lex_subtype_special_symbols:
+                jmp = special_symbols (&f);
+                break;
+
+            case lex_subtype_sing_line_comment:
+                jmp = sing_line_comment (&f);
+                break;
+
+            case lex_subtype_mult_line_comment:
+                if (f.stash) jmp = mult_line_comment_with_stash (&f);
+                else jmp = mult_line_comment_wo_stash (&f);
+                break;
+
+            default:
+                fprintf (stderr, "unexpected program flow\n");
+                abort ();
+        }
+
+        if (jmp) goto *(&&retry_c + jmps[jmp]);
+    }
+
+    spill_lexeme (&f);
+
+    // newlines of the block are counted before it's gone
+
+    locate (&f, f.ctx->pos + input_len);
+    f.ctx->pos += input_len;
+
+    return f.batch ? 1 : 0;
+}
+
+static int
+lex_set_keywords (lua_State *L)
+{
+    // interns the keywords: a simple ident, which is equal to a keyword
+    // in lower case, gets the keyword's index in the list as kw_id.
+    // words with upper case letters are skipped, they are never equal
+
+    struct lex_ctx *ctx = luaL_checkudata (L, 1, lex_ctx_tname);
+    luaL_checktype (L, 2, LUA_TTABLE);
+
+    long count = lua_rawlen (L, 2);
+    long cap = 16;
+
+    while (cap < count * 2) cap *= 2;
+
+    struct lex_kw *kws = calloc (cap, sizeof (*kws));
+
+    if (__builtin_expect (!kws, 0))
+    {
+        fprintf (stderr, "memory allocation error for keyword hash table\n");
+        abort ();
+    }
+
+    for (long id = 1; id <= count; ++id)
+    {
+        size_t len;
+
+        lua_rawgeti (L, 2, id);
+
+        const char *word = lua_tolstring (L, -1, &len);
+
+        if (__builtin_expect (!word || !len || len > lex_kw_max_len, 0))
+        {
+            free (kws);
+
+            return luaL_error (L, "invalid keyword #%d", (int) id);
+        }
+
+        if (!has_upper (word, len))
+        {
+            unsigned long i = hash_keyword (word, len) & (cap - 1);
+
+            while (kws[i].id &&
+                    (kws[i].len != (int) len || memcmp (kws[i].word, word, len)))
+            {
+                i = (i + 1) & (cap - 1);
+            }
+
+            if (!kws[i].id)
+            {
+                kws[i].id = id;
+                kws[i].len = len;
+                memcpy (kws[i].word, word, len);
+            }
+        }
+
+        lua_pop (L, 1);
+    }
+
+    free (ctx->kws);
+    ctx->kws = kws;
+    ctx->kw_cap = cap;
+
+    lua_pushvalue (L, 2);
+    lua_setuservalue (L, 1);
+
+    return 0;
+}
+
+static void
+free_matcher (struct lex_ctx *ctx)
+{
+    if (!ctx->match_prog) return;
+
+    pt_match_free_prog (ctx->match_prog);
+    pt_match_free_run (ctx->match_run);
+    free (ctx->match_prog);
+    free (ctx->match_run);
+    ctx->match_prog = 0;
+    ctx->match_run = 0;
+}
+
+static void *
+calloc_matcher (long count, long size)
+{
+    void *p = calloc (count ? count : 1, size);
+
+    if (__builtin_expect (!p, 0))
+    {
+        fprintf (stderr, "memory allocation error for matcher\n");
+        abort ();
+    }
+
+    return p;
+}
+
+static long
+load_strings (lua_State *L, int arg, struct pt_match_symbol **symbols,
+        char **strings, long strings_len)
+{
+    // appends strings of a list to the string buffer, returns its new
+    // length
+
+    long count = lua_rawlen (L, arg);
+
+    *symbols = calloc_matcher (count, sizeof (**symbols));
+
+    for (long i = 0; i < count; ++i)
+    {
+        size_t len;
+
+        lua_rawgeti (L, arg, i + 1);
+
+        const char *str = lua_tolstring (L, -1, &len);
+
+        if (__builtin_expect (!str, 0))
+        {
+            lua_pop (L, 1);
+
+            return -1 - i;
+        }
+
+        char *new_strings = realloc (*strings, strings_len + len + 1);
+
+        if (__builtin_expect (!new_strings, 0))
+        {
+            fprintf (stderr, "memory allocation error for matcher\n");
+            abort ();
+        }
+
+        memcpy (new_strings + strings_len, str, len + 1);
+        (*symbols)[i] = (struct pt_match_symbol) {strings_len, len};
+        *strings = new_strings;
+        strings_len += len + 1;
+        lua_pop (L, 1);
+    }
+
+    return strings_len;
+}
+
+static const char *
+load_code (lua_State *L, struct pt_match_prog *prog)
+{
+    // instructions are triples in the list (arg 2): op name, arg, arg2.
+    // indexes of instructions, symbols, object types and keys are 1 based
+    // there. returns an error message or 0
+
+    static const char *const op_names[] =
+    {
+        "end", "kw", "ss", "rs", "ident", "str", "op_ident", "en", "any",
+        "fork", "alt", "rep", "jmp", 0,
+    };
+
+    long len = lua_rawlen (L, 2) / 3;
+
+    prog->code_len = len;
+    prog->code = calloc_matcher (len, sizeof (*prog->code));
+
+    for (long pc = 0; pc < len; ++pc)
+    {
+        struct pt_match_insn *insn = &prog->code[pc];
+
+        lua_rawgeti (L, 2, pc * 3 + 1);
+        lua_rawgeti (L, 2, pc * 3 + 2);
+        lua_rawgeti (L, 2, pc * 3 + 3);
+
+        const char *name = lua_tostring (L, -3);
+        lua_Integer arg = lua_tointeger (L, -2);
+
+        insn->arg2 = lua_tointeger (L, -1);
+        lua_pop (L, 3);
+
+        for (insn->op = 0; name && op_names[insn->op]; ++insn->op)
+        {
+            if (!strcmp (op_names[insn->op], name)) break;
+        }
+
+        if (!name || !op_names[insn->op]) return "unknown op";
+
+        switch (insn->op)
+        {
+            case pt_match_op_kw:
+                if (arg < 1) return "invalid keyword id";
+                insn->arg = arg;
+                break;
+
+            case pt_match_op_ss:
+            case pt_match_op_rs:
+                if (arg < 1 || arg > prog->symbol_count)
+                {
+                    return "invalid symbol index";
+                }
+                insn->arg = arg - 1;
+                break;
+
+            case pt_match_op_ident:
+            case pt_match_op_str:
+            case pt_match_op_op_ident:
+                if (arg < 1 || arg > prog->key_count) return "invalid key index";
+                insn->arg = arg - 1;
+                break;
+
+            case pt_match_op_en:
+                if (arg < 1 || arg > prog->obj_type_count)
+                {
+                    return "invalid object type index";
+                }
+                insn->arg = arg - 1;
+                break;
+
+            case pt_match_op_fork:
+                if (arg < 0 || arg > len - pc - 1)
+                {
+                    return "invalid number of alternatives";
+                }
+                insn->arg = arg;
+                break;
+
+            case pt_match_op_alt:
+            case pt_match_op_rep:
+            case pt_match_op_jmp:
+                if (arg < 1 || arg > len) return "invalid target";
+                insn->arg = arg - 1;
+                break;
+        }
+    }
+
+    if (!len || prog->code[len - 1].op != pt_match_op_end)
+    {
+        return "no final end";
+    }
+
+    for (long pc = 0; pc < len; ++pc)
+    {
+        const struct pt_match_insn *insn = &prog->code[pc];
+
+        if (insn->op != pt_match_op_fork) continue;
+
+        for (int k = 1; k <= insn->arg; ++k)
+        {
+            if (insn[k].op != pt_match_op_alt) return "fork without alt";
+        }
+    }
+
+    return 0;
+}
+
+static int
+lex_set_matcher (lua_State *L)
+{
+    // sets pattern rules compiled by split_to_chunks.compile_pattern_rules(),
+    // the statements of batches are matched by them then. args: code,
+    // symbols, object types, starts of patterns, key count, count of
+    // reserved keywords, limit of states per lexeme (nil if no limit),
+    // whether statements are timed. nil instead of code drops the rules
+
+    struct lex_ctx *ctx = luaL_checkudata (L, 1, lex_ctx_tname);
+
+    if (ctx->in_stmt)
+    {
+        // it would miss the statement's beginning
+
+        return luaL_error (L, "matcher can't be set inside of statement");
+    }
+
+    free_matcher (ctx);
+
+    if (lua_isnoneornil (L, 2)) return 0;
+
+    luaL_checktype (L, 2, LUA_TTABLE);
+    luaL_checktype (L, 3, LUA_TTABLE);
+    luaL_checktype (L, 4, LUA_TTABLE);
+    luaL_checktype (L, 5, LUA_TTABLE);
+
+    lua_Integer key_count = luaL_checkinteger (L, 6);
+
+    luaL_argcheck (L, key_count >= 0 && key_count <= pt_match_max_keys, 6,
+            "too many keys");
+
+    lua_Integer max_states = luaL_optinteger (L, 8, 0);
+
+    luaL_argcheck (L, max_states >= 0, 8, "negative limit");
+
+    struct pt_match_prog prog =
+    {
+        .key_count = key_count,
+        .reserved_count = luaL_checkinteger (L, 7),
+    };
+    long strings_len = 0;
+    const char *error = 0;
+
+    prog.symbol_count = lua_rawlen (L, 3);
+    prog.obj_type_count = lua_rawlen (L, 4);
+    strings_len = load_strings (L, 3, &prog.symbols, &prog.strings, 0);
+
+    if (strings_len < 0) error = "invalid symbol";
+    else
+    {
+        strings_len = load_strings (L, 4, &prog.obj_types, &prog.strings,
+                strings_len);
+
+        if (strings_len < 0) error = "invalid object type";
+    }
+
+    if (!error) error = load_code (L, &prog);
+
+    if (!error)
+    {
+        prog.start_count = lua_rawlen (L, 5);
+        prog.starts = calloc_matcher (prog.start_count,
+                sizeof (*prog.starts));
+
+        for (long i = 0; i < prog.start_count; ++i)
+        {
+            lua_rawgeti (L, 5, i + 1);
+
+            lua_Integer pc = lua_tointeger (L, -1);
+
+            lua_pop (L, 1);
+
+            if (pc < 1 || pc > prog.code_len)
+            {
+                error = "invalid start of pattern";
+                break;
+            }
+
+            prog.starts[i] = pc - 1;
+        }
+    }
+
+    if (error)
+    {
+        pt_match_free_prog (&prog);
+
+        return luaL_error (L, "invalid compiled pattern rules: %s", error);
+    }
+
+    pt_match_index_prog (&prog);
+
+    ctx->match_prog = calloc_matcher (1, sizeof (*ctx->match_prog));
+    ctx->match_run = calloc_matcher (1, sizeof (*ctx->match_run));
+    ctx->match_run->max_states = max_states;
+    ctx->match_profile = lua_toboolean (L, 9);
+    *ctx->match_prog = prog;
+
+    return 0;
+}
+
+static int
+lex_free (lua_State *L)
+{
+    struct lex_ctx *ctx = luaL_checkudata (L, 1, lex_ctx_tname);
+
+    free (ctx->buf);
+    free (ctx->kws);
+    free_matcher (ctx);
+    *ctx = (struct lex_ctx) {};
+
+    return 0;
+}
+
+static int
+lex_translate (lua_State *L)
+{
+    // translates a string or comment lexeme given by its subtype and value,
+    // returns nil for other subtypes and invalid values
+
+    lua_Integer subtype = luaL_checkinteger (L, 1);
+    size_t len;
+    const char *buf = luaL_checklstring (L, 2, &len);
+    long marker_len = 0;
+
+    if (subtype == lex_subtype_dollar_string && len && buf[0] == '$')
+    {
+        const char *marker_end = memchr (buf + 1, '$', len - 1);
+
+        if (marker_end) marker_len = marker_end - buf + 1;
+    }
+
+    push_translated (L, subtype, buf, len, marker_len);
+
+    return 1;
+}
+
+static int
+push_batch_lexeme (lua_State *L, struct lex_batch *batch, int batch_idx,
+        long i)
+{
+    const char *buf;
+    long voff = batch->voff[i];
+
+    lua_getuservalue (L, batch_idx);
+    lua_rawgeti (L, -1, 2);
+
+    int keywords_idx = lua_gettop (L);
+
+    if (voff >= 0)
+    {
+        lua_rawgeti (L, -2, 1);
+
+        struct os_ext_map *map = luaL_testudata (L, -1, OS_EXT_MAP_TNAME);
+
+        if (map)
+        {
+            if (__builtin_expect (map->fd == -1, 0))
+            {
+                luaL_error (L, "the batch refers to a closed map");
+            }
+
+            buf = map->data + batch->input_off + voff;
+        }
+        else
+        {
+            buf = lua_tostring (L, -1) + voff;
+        }
+
+        lua_pop (L, 1); // the input block is still kept by the batch
+    }
+    else
+    {
+        buf = batch->extra - 1 - voff;
+    }
+
+    push_lexeme (L, batch->type[i], batch->subtype[i],
+            batch->lpos[i], batch->lline[i], batch->lcol[i],
+            buf, batch->vlen[i], batch->aux[i], keywords_idx,
+            batch->trans_more);
+
+    lua_pushinteger (L, batch->level[i]);
+
+    lua_rotate (L, keywords_idx - 1, -2);
+    lua_pop (L, 2);
+
+    return 7;
+}
+
+static int
+lex_batch_count (lua_State *L)
+{
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+
+    lua_pushinteger (L, batch->count);
+
+    return 1;
+}
 
-            f->ctx->stash = f->c;
-            break;
-
-        case 0:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unterminated lexeme: escape_string",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col);
-            __builtin_unreachable ();
+static int
+lex_batch_get (lua_State *L)
+{
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer i = luaL_checkinteger (L, 2);
 
-        default:
-            push_c_to_buf (f->L, f->ctx, f->c);
-    }
+    luaL_argcheck (L, i >= 1 && i <= batch->count, 2,
+            "lexeme index out of range");
 
-    return 0;
+    return push_batch_lexeme (L, batch, 1, i - 1);
 }
 
-static inline int
-simple_or_escape_string_with_stash (struct lex_feed_ctx *f)
+static int
+lex_batch_stmt_count (lua_State *L)
 {
-    if (__builtin_expect (f->stash != '\'', 0)) {
-        fprintf (stderr, "unexpected program flow\n");
-        abort ();
-    }
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
 
-    if (f->c == '\'')
-    {
-        push_str_to_buf (f->L, f->ctx, "''", 2);
-    }
-    else
-    {
-        push_c_to_buf (f->L, f->ctx, f->stash);
-        finish_lexeme (f);
-        return 1;
-    }
+    lua_pushinteger (L, batch->stmt_count);
 
-    return 0;
+    return 1;
 }
 
-static inline int
-dollar_string (struct lex_feed_ctx *f)
+static int
+lex_batch_stmt (lua_State *L)
 {
-    if (__builtin_expect (f->c == 0, 0))
-    {
-        luaL_error (f->L,
-                "pos(%I) line(%I) col(%I): "
-                "unterminated lexeme: dollar_string ",
-                (lua_Integer) f->ctx->pos,
-                (lua_Integer) f->ctx->line,
-                (lua_Integer) f->ctx->col);
-        __builtin_unreachable ();
-    }
+    // returns begin_pos, end_pos, index of the final ``;`` and keyword ids
+    // of the first significant lexemes. begin_pos could be in one of
+    // previous blocks
 
-    push_c_to_buf (f->L, f->ctx, f->c);
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer j = luaL_checkinteger (L, 2);
 
-    if (f->c != '$')
-    {
-        return 0;
-    }
+    luaL_argcheck (L, j >= 1 && j <= batch->stmt_count, 2,
+            "statement index out of range");
 
-    long len = f->ctx->len;
-    long marker_len = f->ctx->state.dollar_string.marker_len;
-    const char *buf = f->ctx->buf;
+    const struct lex_stmt *stmt = &batch->stmts[j - 1];
 
-    if (!marker_len)
-    {
-        if (__builtin_expect (len < 2, 0))
-        {
-            fprintf (stderr, "unexpected program flow\n");
-            abort ();
-        }
+    lua_pushinteger (L, stmt->begin_pos);
+    lua_pushinteger (L, stmt->end_pos);
+    lua_pushinteger (L, stmt->last_i + 1);
 
-        f->ctx->state.dollar_string.marker_len = len;
-    }
-    else if (len >= marker_len * 2 &&
-            !memcmp (buf + len - marker_len, buf, marker_len))
-    {
-        finish_lexeme_with_state (f);
-    }
+    for (int k = 0; k < stmt->nkws; ++k) lua_pushinteger (L, stmt->kws[k]);
 
-    return 0;
+    return 3 + stmt->nkws;
 }
 
-static inline int
-special_symbols (struct lex_feed_ctx *f)
+static int
+lex_batch_stmt_match (lua_State *L)
 {
-    if (__builtin_expect (!f->ctx->len, 0))
-    {
-        fprintf (stderr, "unexpected program flow\n");
-        abort ();
-    }
+    // returns how the statement is matched by the lexer's pattern rules:
+    // object type index (nil if none), its priority, where the patterns
+    // have failed (nil if they haven't), then pairs of key index and value
 
-    if (f->ctx->len == 1 && (f->c == '.' || f->c == ':') &&
-                f->ctx->buf[0] == f->c)
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer j = luaL_checkinteger (L, 2);
+
+    luaL_argcheck (L, j >= 1 && j <= batch->stmt_count, 2,
+            "statement index out of range");
+
+    const struct lex_stmt *stmt = &batch->stmts[j - 1];
+
+    luaL_checkstack (L, 3 + stmt->cap_count * 2, 0);
+
+    if (stmt->obj == -1)
     {
-        push_c_to_buf (f->L, f->ctx, f->c);
-        finish_lexeme (f);
+        lua_pushnil (L);
+        lua_pushnil (L);
     }
     else
     {
-        finish_lexeme (f);
-        return 1;
+        lua_pushinteger (L, stmt->obj + 1);
+        lua_pushinteger (L, stmt->obj_priority);
     }
 
-    return 0;
-}
+    if (stmt->dead_end_pos) lua_pushinteger (L, stmt->dead_end_pos);
+    else lua_pushnil (L);
 
-static inline int
-random_symbols (struct lex_feed_ctx *f)
-{
-    switch (f->c)
+    for (int k = 0; k < stmt->cap_count; ++k)
     {
-        case '`':
-        case '~':
-        case '!':
-        case '@':
-        case '#':
-        case '%':
-        case '^':
-        case '&':
-        case '*':
-        case '-':
-        case '=':
-        case '+':
-        case '|':
-        case '<':
-        case '>':
-        case '?':
-        case '/':
-            push_c_to_buf (f->L, f->ctx, f->c);
-            break;
+        const struct lex_stmt_cap *cap = &batch->caps[stmt->cap_off + k];
+        const char *buf = batch->cap_bytes + cap->off;
 
-        default:
-            finish_lexeme (f);
-            return 1;
-    }
+        lua_pushinteger (L, cap->key + 1);
 
-    return 0;
-}
+        switch (cap->op)
+        {
+            case pt_match_op_ident:
+                if (cap->subtype == lex_subtype_simple_ident)
+                {
+                    push_lowered (L, buf, cap->len);
+                }
+                else
+                {
+                    push_quoted_lexeme_translated (L, cap->len, buf, '"');
+                }
+                break;
 
-static inline int
-sing_line_comment (struct lex_feed_ctx *f)
-{
-    switch (f->c)
-    {
-        case '\n':
-        case 0:
-            finish_lexeme (f);
-            return 1;
+            case pt_match_op_str:
+                push_translated (L, cap->subtype, buf, cap->len, cap->aux);
+                break;
 
-        default:
-            push_c_to_buf (f->L, f->ctx, f->c);
+            default:
+                lua_pushlstring (L, buf, cap->len);
+        }
     }
 
-    return 0;
+    return 3 + stmt->cap_count * 2;
 }
 
-static inline int
-mult_line_comment_wo_stash (struct lex_feed_ctx *f)
+static int
+lex_batch_pending_stmt (lua_State *L)
 {
-    switch (f->c)
-    {
-        case '*':
-            if (__builtin_expect (f->ctx->len < 2, 0))
-            {
-                fprintf (stderr, "unexpected program flow\n");
-                abort ();
-            }
-
-            f->ctx->stash = f->c;
-            break;
-
-        case 0:
-            luaL_error (f->L,
-                    "pos(%I) line(%I) col(%I): "
-                    "unterminated lexeme: mult_line_comment",
-                    (lua_Integer) f->ctx->pos,
-                    (lua_Integer) f->ctx->line,
-                    (lua_Integer) f->ctx->col);
-            __builtin_unreachable ();
+    // returns position of the statement unfinished at the end of stream
+    // with its line and column, and where its patterns have failed (nil if
+    // they haven't), or nothing if there's no such statement
 
-        default:
-            push_c_to_buf (f->L, f->ctx, f->c);
-    }
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
 
-    return 0;
-}
+    if (!batch->has_pending) return 0;
 
-static inline int
-mult_line_comment_with_stash (struct lex_feed_ctx *f)
-{
-    if (__builtin_expect (f->stash != '*', 0)) {
-        fprintf (stderr, "unexpected program flow\n");
-        abort ();
-    }
+    lua_pushinteger (L, batch->pending.begin_pos);
+    lua_pushinteger (L, batch->pending.lline);
+    lua_pushinteger (L, batch->pending.lcol);
 
-    if (f->c == '/')
+    if (batch->pending.dead_end_pos)
     {
-        push_str_to_buf (f->L, f->ctx, "*/", 2);
-        finish_lexeme (f);
+        lua_pushinteger (L, batch->pending.dead_end_pos);
     }
     else
     {
-        push_c_to_buf (f->L, f->ctx, f->stash);
-        return 1;
+        lua_pushnil (L);
     }
 
-    return 0;
+    return 4;
 }
 
 static int
-lex_feed (lua_State *L)
+lex_batch_stmt_location (lua_State *L)
 {
-    struct lex_feed_ctx f = {
-        .L = L,
-        .ctx = luaL_checkudata (L, 1, lex_ctx_tname),
-        .not_exists_callback = lua_isnil (L, 3), // arg: callback function
-        .trans_more = lua_toboolean (L, 4), // arg: translate more?
-    };
-    size_t input_len = 0;
-    const char *input = lua_tolstring (L, 2, &input_len);
-    const int jmps[] = {0, &&retry_c - &&retry_c, &&retry_c - &&retry_stash};
-    int jmp;
+    // returns line and column of the statement's first lexeme
 
-    if (__builtin_expect (!input_len, 0))
-    {
-        // the final mark for flushing rest of buffer.
-        // it should not be counted in position counters
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer j = luaL_checkinteger (L, 2);
 
-        input = "\0";
-        input_len = 1;
-    }
+    luaL_argcheck (L, j >= 1 && j <= batch->stmt_count, 2,
+            "statement index out of range");
 
-    for (size_t input_i = 0; input_i < input_len; ++input_i)
-    {
-        f.c = input[input_i];
+    lua_pushinteger (L, batch->stmts[j - 1].lline);
+    lua_pushinteger (L, batch->stmts[j - 1].lcol);
 
-        if (__builtin_expect (f.c, 1))
-        {
-            f.ctx->ppos = f.ctx->pos;
-            f.ctx->pline = f.ctx->line;
-            f.ctx->pcol = f.ctx->col;
+    return 2;
+}
 
-            if (!f.ctx->line) f.ctx->line = 1;
+static int
+lex_batch_stmt_profile (lua_State *L)
+{
+    // returns lexemes matched, the peak number of alive states of patterns
+    // and processor seconds spent (0 unless the matcher profiles)
 
-            ++f.ctx->pos;
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer j = luaL_checkinteger (L, 2);
 
-            if (f.c == '\n')
-            {
-                ++f.ctx->line;
-                f.ctx->col = 0;
-            }
-            else
-            {
-                ++f.ctx->col;
-            }
-        }
+    luaL_argcheck (L, j >= 1 && j <= batch->stmt_count, 2,
+            "statement index out of range");
 
-retry_c:
-        f.stash = f.ctx->stash;
-        f.ctx->stash = 0;
+    lua_pushinteger (L, batch->stmts[j - 1].lexemes);
+    lua_pushinteger (L, batch->stmts[j - 1].peak_states);
+    lua_pushnumber (L, batch->stmts[j - 1].elapsed);
 
-retry_stash:
-        jmp = 0;
+    return 3;
+}
 
-        switch (f.ctx->subtype)
-        {
-            case lex_subtype_undefined:
-                if (f.stash) jmp = undefined_with_stash (&f);
-                else jmp = undefined_wo_stash (&f);
-                break;
+static int
+lex_batch_next_stmt_end (lua_State *L)
+{
+    // returns index of the first lexeme at or after i, which finishes
+    // a statement, or nothing if the statement goes on in next blocks.
+    // a lexeme falling below level 1 finishes it too, as an error
 
-            case lex_subtype_simple_ident:
-                jmp = simple_ident (&f);
-                break;
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer i = luaL_checkinteger (L, 2) - 1;
+    long lo = 0;
+    long hi = batch->stmt_count;
 
-            case lex_subtype_quoted_ident:
-                if (f.stash) jmp = quoted_ident_with_stash (&f);
-                else jmp = quoted_ident_wo_stash (&f);
-                break;
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
 
-            case lex_subtype_number:
-                if (f.stash) jmp = number_with_stash (&f);
-                else jmp = number_wo_stash (&f);
-                break;
+        if (batch->stmts[mid].last_i < i) lo = mid + 1;
+        else hi = mid;
+    }
 
-            case lex_subtype_simple_string:
-                if (f.stash) jmp = simple_or_escape_string_with_stash (&f);
-                else jmp = simple_string_wo_stash (&f);
-                break;
+    long error_i = batch->level_error_i - 1;
 
-            case lex_subtype_escape_string:
-                if (f.stash) jmp = simple_or_escape_string_with_stash (&f);
-                else jmp = escape_string_wo_stash (&f);
-                break;
+    if (error_i >= i &&
+            (lo == batch->stmt_count || error_i < batch->stmts[lo].last_i))
+    {
+        lua_pushinteger (L, error_i + 1);
 
-            case lex_subtype_dollar_string:
-                jmp = dollar_string (&f);
-                break;
+        return 1;
+    }
 
-            case lex_subtype_special_symbols:
-                jmp = special_symbols (&f);
-                break;
+    if (lo == batch->stmt_count) return 0;
 
-            case lex_subtype_random_symbols:
-                jmp = random_symbols (&f);
-                break;
+    lua_pushinteger (L, batch->stmts[lo].last_i + 1);
 
-            case lex_subtype_sing_line_comment:
-                jmp = sing_line_comment (&f);
-                break;
+    return 1;
+}
 
-            case lex_subtype_mult_line_comment:
-                if (f.stash) jmp = mult_line_comment_with_stash (&f);
-                else jmp = mult_line_comment_wo_stash (&f);
-                break;
+static int
+lex_batch_count_significant (lua_State *L)
+{
+    // returns number of lexemes from i to j, which aren't comments. it
+    // looks at the types only, unlike get()
 
-            default:
-                fprintf (stderr, "unexpected program flow\n");
-                abort ();
-        }
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+    lua_Integer i = luaL_checkinteger (L, 2);
+    lua_Integer j = luaL_checkinteger (L, 3);
+    long count = 0;
 
-        if (jmp) goto *(&&retry_c + jmps[jmp]);
+    if (i < 1) i = 1;
+    if (j > batch->count) j = batch->count;
+
+    for (lua_Integer k = i - 1; k < j; ++k)
+    {
+        if (batch->type[k] != lex_type_comment) ++count;
     }
 
-    return 0;
+    lua_pushinteger (L, count);
+
+    return 1;
 }
 
 static int
-lex_free (lua_State *L)
+lex_batch_iter (lua_State *L)
 {
-    struct lex_ctx *ctx = luaL_checkudata (L, 1, lex_ctx_tname);
+    struct lex_batch *batch = lua_touserdata (L, lua_upvalueindex (1));
+    lua_Integer i = lua_tointeger (L, lua_upvalueindex (2));
 
-    free (ctx->buf);
-    *ctx = (struct lex_ctx) {};
+    if (i >= batch->count) return 0;
+
+    lua_pushinteger (L, i + 1);
+    lua_replace (L, lua_upvalueindex (2));
+
+    return push_batch_lexeme (L, batch, lua_upvalueindex (1), i);
+}
+
+static int
+lex_batch_items (lua_State *L)
+{
+    luaL_checkudata (L, 1, lex_batch_tname);
+
+    lua_settop (L, 1);
+    lua_pushinteger (L, 0);
+    lua_pushcclosure (L, lex_batch_iter, 2);
+
+    return 1;
+}
+
+static int
+lex_batch_free (lua_State *L)
+{
+    struct lex_batch *batch = luaL_checkudata (L, 1, lex_batch_tname);
+
+    free (batch->type);
+    free (batch->subtype);
+    free (batch->lpos);
+    free (batch->lline);
+    free (batch->lcol);
+    free (batch->voff);
+    free (batch->vlen);
+    free (batch->aux);
+    free (batch->level);
+    free (batch->stmts);
+    free (batch->caps);
+    free (batch->cap_bytes);
+    free (batch->extra);
+    *batch = (struct lex_batch) {};
 
     return 0;
 }
@@ -1200,8 +2847,11 @@ lex_free (lua_State *L)
 static const luaL_Reg lex_reg[] =
 {
     {"make_ctx", lex_make_ctx},
+    {"set_keywords", lex_set_keywords},
     {"feed", lex_feed},
+    {"set_matcher", lex_set_matcher},
     {"free", lex_free},
+    {"translate", lex_translate},
     {0, 0},
 };
 
@@ -1211,7 +2861,11 @@ luaopen_lex (lua_State *L)
     lua_createtable (L, 0, 3);
     lua_pushstring (L, lex_ctx_tname);
     lua_setfield (L, -2, "__name");
-    lua_createtable (L, 0, 2);
+    lua_createtable (L, 0, 4);
+    lua_pushcfunction (L, lex_set_keywords);
+    lua_setfield (L, -2, "set_keywords");
+    lua_pushcfunction (L, lex_set_matcher);
+    lua_setfield (L, -2, "set_matcher");
     lua_pushcfunction (L, lex_feed);
     lua_setfield (L, -2, "feed");
     lua_pushcfunction (L, lex_free);
@@ -1221,7 +2875,40 @@ luaopen_lex (lua_State *L)
     lua_setfield (L, -2, "__gc");
     lua_setfield (L, LUA_REGISTRYINDEX, lex_ctx_tname);
 
-    lua_createtable (L, 0, 3 + 1);
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, lex_batch_tname);
+    lua_setfield (L, -2, "__name");
+    lua_createtable (L, 0, 12);
+    lua_pushcfunction (L, lex_batch_count);
+    lua_setfield (L, -2, "count");
+    lua_pushcfunction (L, lex_batch_get);
+    lua_setfield (L, -2, "get");
+    lua_pushcfunction (L, lex_batch_items);
+    lua_setfield (L, -2, "items");
+    lua_pushcfunction (L, lex_batch_stmt_count);
+    lua_setfield (L, -2, "stmt_count");
+    lua_pushcfunction (L, lex_batch_stmt);
+    lua_setfield (L, -2, "stmt");
+    lua_pushcfunction (L, lex_batch_stmt_match);
+    lua_setfield (L, -2, "stmt_match");
+    lua_pushcfunction (L, lex_batch_stmt_location);
+    lua_setfield (L, -2, "stmt_location");
+    lua_pushcfunction (L, lex_batch_pending_stmt);
+    lua_setfield (L, -2, "pending_stmt");
+    lua_pushcfunction (L, lex_batch_stmt_profile);
+    lua_setfield (L, -2, "stmt_profile");
+    lua_pushcfunction (L, lex_batch_next_stmt_end);
+    lua_setfield (L, -2, "next_stmt_end");
+    lua_pushcfunction (L, lex_batch_count_significant);
+    lua_setfield (L, -2, "count_significant");
+    lua_pushcfunction (L, lex_batch_free);
+    lua_setfield (L, -2, "free");
+    lua_setfield (L, -2, "__index");
+    lua_pushcfunction (L, lex_batch_free);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, lex_batch_tname);
+
+    lua_createtable (L, 0, 6 + 1);
     luaL_setfuncs (L, lex_reg, 0);
 
     lua_createtable (L, 0, 6 + 11);
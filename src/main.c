@@ -1,4 +1,4 @@
-// abort, free
+// abort, free, strtol
 #include <stdlib.h>
 
 // strlen, strdup
@@ -58,6 +58,8 @@ struct arguments
     int relaxed_order;
     int split_stateless;
     char *sql_footer;
+    char *profile_path;
+    long jobs;
     char *dump_path;
     char *output_dir;
     char *hooks_path;
@@ -92,6 +94,19 @@ static struct argp_option argp_options[] =
         .arg = "SQL-FOOTER",
         .doc = "A footer that will be added at end of each sorted dump chunk",
     },
+    {
+        .name = "profile",
+        .key = 'P',
+        .arg = "REPORT-FILE",
+        .doc = "Profile pattern matching of statements, write the most "
+                "expensive ones and totals by object type to a report file",
+    },
+    {
+        .name = "jobs",
+        .key = 'j',
+        .arg = "N",
+        .doc = "Sort dump chunks by N threads",
+    },
     {
         .name = "hooks",
         .key = 'k',
@@ -135,6 +150,33 @@ argp_parser (int key, char *arg, struct argp_state *state)
             arguments->sql_footer = strdup (arg);
             break;
 
+        case 'P':
+            if (arguments->profile_path)
+            {
+                argp_error (state,
+                        "attempt to redefine argument for option \"profile\"");
+                return EINVAL;
+            }
+
+            arguments->profile_path = strdup (arg);
+            break;
+
+        case 'j':
+            {
+                char *end;
+
+                arguments->jobs = strtol (arg, &end, 10);
+
+                if (*end || arguments->jobs < 1)
+                {
+                    argp_error (state,
+                            "invalid argument for option \"jobs\"");
+                    return EINVAL;
+                }
+            }
+
+            break;
+
         case 'k':
             if (arguments->hooks_path)
             {
@@ -225,11 +267,21 @@ bootstrap (lua_State *L)
         lua_pushvalue (L, 5);
         lua_setfield (L, -2, "sql_footer");
     }
+    if (lua_toboolean (L, 6)) // arg: profile_path
+    {
+        lua_pushvalue (L, 6);
+        lua_setfield (L, -2, "profile_path");
+    }
+    if (lua_tointeger (L, 7)) // arg: jobs
+    {
+        lua_pushvalue (L, 7);
+        lua_setfield (L, -2, "jobs");
+    }
 
     lua_getfield (L, -2, "pg_dump_splitter");
-    lua_pushvalue (L, 6); // arg: dump_path
-    lua_pushvalue (L, 7); // arg: output_dir
-    lua_pushvalue (L, 8); // arg: hooks_path
+    lua_pushvalue (L, 8); // arg: dump_path
+    lua_pushvalue (L, 9); // arg: output_dir
+    lua_pushvalue (L, 10); // arg: hooks_path
     lua_pushvalue (L, -5); // var: options
     lua_call (L, 4, 0);
 
@@ -273,15 +325,18 @@ main (int argc, char *argv[])
     lua_pushboolean (L, arguments.relaxed_order);
     lua_pushboolean (L, arguments.split_stateless);
     lua_pushstring (L, arguments.sql_footer);
+    lua_pushstring (L, arguments.profile_path);
+    lua_pushinteger (L, arguments.jobs);
     lua_pushstring (L, arguments.dump_path);
     lua_pushstring (L, arguments.output_dir);
     lua_pushstring (L, arguments.hooks_path);
     free (arguments.sql_footer);
+    free (arguments.profile_path);
     free (arguments.dump_path);
     free (arguments.output_dir);
     free (arguments.hooks_path);
 
-    int lua_err = lua_pcall (L, 8, 0, -10);
+    int lua_err = lua_pcall (L, 10, 0, -12);
 
     if (lua_err)
     {
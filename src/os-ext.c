@@ -1,16 +1,122 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+// abort, malloc, free
+#include <stdlib.h>
+
+// fprintf, stderr
+#include <stdio.h>
+
 // errono
 #include <errno.h>
 
-// strerror_l
+// strerror_l, memcpy
 #include <string.h>
 
-// mkdir S_I*
+// mkdir S_I* fstat S_ISREG
 #include <sys/stat.h>
 
+// open openat mkdirat O_*, posix_fadvise POSIX_FADV_*
+#include <fcntl.h>
+
+// close, sysconf
+#include <unistd.h>
+
+// writev, struct iovec
+#include <sys/uio.h>
+
+// mmap munmap madvise PROT_* MAP_* MADV_*
+#include <sys/mman.h>
+
+// getrlimit RLIMIT_NOFILE RLIM_INFINITY
+#include <sys/resource.h>
+
+#include "pg-dump-splitter-config.h"
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+// io_uring_*
+#include <liburing.h>
+#endif
+
 #include "pg-dump-splitter.h"
+#include "os-ext.h"
+
+// pages behind the cursor are dropped by steps not smaller than this one,
+// so dropping costs a couple of syscalls per several megabytes
+
+static const long os_ext_map_drop_step = 8 * 1024 * 1024;
+
+// directory opened by os_ext.open_dir(), paths relative to it are resolved
+// from it instead of the root or the current directory
+
+#define OS_EXT_DIR_TNAME "os_ext.dir"
+
+struct os_ext_dir
+{
+    int fd;             // file descriptor, -1 after closing
+};
+
+// writer made by os_ext.open_writer(). written strings are not copied,
+// they are kept in the writer's user value till they are written by one
+// writev(). with io_uring the writev() is submitted and the writer goes on,
+// the strings are kept till its completion
+
+#define OS_EXT_WRITER_TNAME "os_ext.writer"
+#define OS_EXT_RING_TNAME "os_ext.ring"
+
+enum
+{
+    os_ext_writer_max_iov = 1024,   // IOV_MAX of Linux
+};
+
+static const long os_ext_writer_flush_size = 1024 * 1024;
+
+// the file of a writer, shared by its writes in flight, the last of them
+// closes it
+
+struct os_ext_writer_file
+{
+    int fd;
+    long in_flight;
+    int is_closed;      // by the writer
+};
+
+struct os_ext_writer
+{
+    struct os_ext_writer_file *file;    // 0 after closing
+    int use_ring;
+    long pos;                           // offset of the next write
+    long iov_count;
+    long iov_bytes;
+    struct iovec iov[os_ext_writer_max_iov];
+};
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+
+// one ring per lua state, so worker threads don't share it
+
+static const long os_ext_ring_entries = 64;
+
+struct os_ext_ring
+{
+    struct io_uring ring;
+    int is_init;
+    long in_flight;
+    char err[256];      // the first error of completions, empty if none
+};
+
+struct os_ext_ring_op
+{
+    struct os_ext_writer_file *file;
+    struct iovec *iov;  // the rest of a short write begins at iov_first
+    long iov_first;
+    long iov_count;
+    long pos;           // offset of the rest
+    long bytes;         // bytes of the rest
+    int strings_ref;    // the written strings in the registry
+};
+
+#endif
 
 static int
 os_ext_mkdir (lua_State *L)
@@ -32,17 +138,843 @@ os_ext_mkdir (lua_State *L)
     return 1;
 }
 
+static int
+os_ext_open_dir (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+
+    int fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror_l (errno, 0));
+
+        return 2;
+    }
+
+    struct os_ext_dir *dir = lua_newuserdata (L, sizeof (*dir));
+
+    *dir = (struct os_ext_dir)
+    {
+        .fd = fd,
+    };
+
+    luaL_setmetatable (L, OS_EXT_DIR_TNAME);
+
+    return 1;
+}
+
+static int
+os_ext_dir_mkdir (lua_State *L)
+{
+    // like os_ext.mkdir(), the path is relative to the directory
+
+    struct os_ext_dir *dir = luaL_checkudata (L, 1, OS_EXT_DIR_TNAME);
+    const char *dir_path = luaL_checkstring (L, 2);
+
+    if (__builtin_expect (dir->fd == -1, 0))
+    {
+        return luaL_error (L, "attempt to use a closed dir");
+    }
+
+    int status = mkdirat (dir->fd, dir_path, 0777);
+
+    if (status)
+    {
+        lua_pushboolean (L, 0);
+        lua_pushstring (L, strerror_l (errno, 0));
+
+        return 2;
+    }
+
+    lua_pushboolean (L, 1);
+
+    return 1;
+}
+
+static int
+os_ext_dir_close (lua_State *L)
+{
+    struct os_ext_dir *dir = luaL_checkudata (L, 1, OS_EXT_DIR_TNAME);
+
+    if (dir->fd == -1) return 0;
+
+    close (dir->fd);
+    dir->fd = -1;
+
+    return 0;
+}
+
+static void
+release_file (struct os_ext_writer_file *file)
+{
+    if (file->in_flight || !file->is_closed) return;
+
+    close (file->fd);
+    free (file);
+}
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+
+static struct os_ext_ring *
+get_ring (lua_State *L)
+{
+    // the ring of the lua state, it's made by the first use. returns 0 if
+    // io_uring isn't available at run time (seccomp, io_uring_disabled,
+    // an old kernel), the failure is kept too, so it's tried once
+
+    struct os_ext_ring *ring;
+
+    if (lua_getfield (L, LUA_REGISTRYINDEX, OS_EXT_RING_TNAME)
+            == LUA_TUSERDATA)
+    {
+        ring = lua_touserdata (L, -1);
+        lua_pop (L, 1);
+
+        return ring->is_init ? ring : 0;
+    }
+
+    lua_pop (L, 1);
+
+    ring = lua_newuserdata (L, sizeof (*ring));
+    *ring = (struct os_ext_ring) {};
+    luaL_setmetatable (L, OS_EXT_RING_TNAME);
+    ring->is_init = !io_uring_queue_init (os_ext_ring_entries,
+            &ring->ring, 0);
+    lua_setfield (L, LUA_REGISTRYINDEX, OS_EXT_RING_TNAME);
+
+    return ring->is_init ? ring : 0;
+}
+
+static int
+submit_op (struct os_ext_ring *ring, struct os_ext_ring_op *op)
+{
+    // returns a negative errno if the write isn't submitted
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&ring->ring);
+
+    if (!sqe) return -EBUSY;
+
+    io_uring_prep_writev (sqe, op->file->fd, op->iov + op->iov_first,
+            op->iov_count - op->iov_first, op->pos);
+    io_uring_sqe_set_data (sqe, op);
+
+    int err = io_uring_submit (&ring->ring);
+
+    return err < 0 ? err : 0;
+}
+
+static void
+set_ring_err (struct os_ext_ring *ring, const char *what, int err)
+{
+    // the first error is kept
+
+    if (ring->err[0]) return;
+
+    snprintf (ring->err, sizeof (ring->err), "%s: %s", what,
+            err ? strerror_l (err, 0) : "nothing is written");
+}
+
+static void
+complete_op (lua_State *L, struct os_ext_ring *ring, struct io_uring_cqe *cqe)
+{
+    // the rest of a short write is submitted again, like flush_writer()
+    // does it
+
+    struct os_ext_ring_op *op = io_uring_cqe_get_data (cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen (&ring->ring, cqe);
+
+    if (res == -EINTR || res == -EAGAIN) res = 0;
+    else if (res <= 0) goto done;
+
+    op->pos += res;
+    op->bytes -= res;
+
+    if (!op->bytes) goto done;
+
+    while ((size_t) res >= op->iov[op->iov_first].iov_len)
+    {
+        res -= op->iov[op->iov_first].iov_len;
+        ++op->iov_first;
+    }
+
+    op->iov[op->iov_first].iov_base =
+            (char *) op->iov[op->iov_first].iov_base + res;
+    op->iov[op->iov_first].iov_len -= res;
+
+    res = submit_op (ring, op);
+
+    if (!res) return;
+
+    set_ring_err (ring, "io_uring_submit", -res);
+    goto release;
+
+done:
+    if (op->bytes) set_ring_err (ring, "writev", -res);
+
+release:
+    --ring->in_flight;
+    --op->file->in_flight;
+    release_file (op->file);
+    luaL_unref (L, LUA_REGISTRYINDEX, op->strings_ref);
+    free (op->iov);
+    free (op);
+}
+
+static int
+wait_ring (lua_State *L, struct os_ext_ring *ring, long max_in_flight)
+{
+    // completes writes till no more than max_in_flight are left.
+    // returns a negative errno if the ring can't be waited for
+
+    while (ring->in_flight > max_in_flight)
+    {
+        struct io_uring_cqe *cqe;
+        int err = io_uring_wait_cqe (&ring->ring, &cqe);
+
+        if (err == -EINTR) continue;
+
+        if (err) return err;
+
+        complete_op (L, ring, cqe);
+    }
+
+    return 0;
+}
+
+static void
+check_wait_ring (lua_State *L, struct os_ext_ring *ring, long max_in_flight)
+{
+    int err = wait_ring (L, ring, max_in_flight);
+
+    if (err)
+    {
+        luaL_error (L, "io_uring_wait_cqe: %s", strerror_l (-err, 0));
+    }
+}
+
+static int
+os_ext_ring_gc (lua_State *L)
+{
+    // errors can't be raised here. the writes are waited for, their
+    // errors are ignored, nobody would get them
+
+    struct os_ext_ring *ring = luaL_checkudata (L, 1, OS_EXT_RING_TNAME);
+
+    if (!ring->is_init) return 0;
+
+    wait_ring (L, ring, 0);
+    io_uring_queue_exit (&ring->ring);
+    ring->is_init = 0;
+
+    return 0;
+}
+
+static int
+submit_to_ring (lua_State *L, struct os_ext_writer *writer)
+{
+    // the iovecs and the strings are moved to the operation. returns zero
+    // if there is no ring
+
+    struct os_ext_ring *ring = get_ring (L);
+
+    if (!ring) return 0;
+
+    // each write is submitted at once, so a queue entry is free. the
+    // completions are bounded by the same number
+
+    if (ring->in_flight >= os_ext_ring_entries)
+    {
+        check_wait_ring (L, ring, os_ext_ring_entries / 2);
+    }
+
+    struct os_ext_ring_op *op = malloc (sizeof (*op));
+    struct iovec *iov = malloc (writer->iov_count * sizeof (*iov));
+
+    if (__builtin_expect (!op || !iov, 0))
+    {
+        fprintf (stderr, "memory allocation error for write operation\n");
+        abort ();
+    }
+
+    memcpy (iov, writer->iov, writer->iov_count * sizeof (*iov));
+
+    *op = (struct os_ext_ring_op)
+    {
+        .file = writer->file,
+        .iov = iov,
+        .iov_count = writer->iov_count,
+        .pos = writer->pos,
+        .bytes = writer->iov_bytes,
+    };
+
+    int err = submit_op (ring, op);
+
+    if (err)
+    {
+        free (iov);
+        free (op);
+        luaL_error (L, "io_uring_submit: %s", strerror_l (-err, 0));
+    }
+
+    lua_getuservalue (L, 1);
+    op->strings_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+    ++ring->in_flight;
+    ++writer->file->in_flight;
+
+    return 1;
+}
+
+#endif
+
+static void
+flush_writer (lua_State *L, struct os_ext_writer *writer)
+{
+    // the writer is at index 1
+
+    if (!writer->iov_count) return;
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+    if (writer->use_ring)
+    {
+        if (submit_to_ring (L, writer)) goto flushed;
+
+        // without io_uring the writer goes on by writev()
+
+        writer->use_ring = 0;
+    }
+#endif
+
+    struct iovec *iov = writer->iov;
+    long iov_count = writer->iov_count;
+
+    while (iov_count)
+    {
+        ssize_t n = writev (writer->file->fd, iov, iov_count);
+
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+
+            luaL_error (L, "writev: %s", strerror_l (errno, 0));
+        }
+
+        // the rest of a short write
+
+        while (iov_count && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+
+        if (iov_count)
+        {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+flushed:
+#endif
+    writer->pos += writer->iov_bytes;
+    writer->iov_count = 0;
+    writer->iov_bytes = 0;
+
+    lua_createtable (L, os_ext_writer_max_iov, 0);
+    lua_setuservalue (L, 1);
+}
+
+static struct os_ext_writer *
+check_open_writer (lua_State *L)
+{
+    struct os_ext_writer *writer = luaL_checkudata (L, 1, OS_EXT_WRITER_TNAME);
+
+    if (__builtin_expect (!writer->file, 0))
+    {
+        luaL_error (L, "attempt to use a closed writer");
+    }
+
+    return writer;
+}
+
+static int
+os_ext_open_writer (lua_State *L)
+{
+    // opens the file for writing from its beginning, like io.open(path, 'wb').
+    // the second argument asks for io_uring, it's ignored without it
+
+    const char *path = luaL_checkstring (L, 1);
+    int use_ring = lua_toboolean (L, 2);
+
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd == -1)
+    {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror_l (errno, 0));
+
+        return 2;
+    }
+
+    struct os_ext_writer *writer = lua_newuserdata (L, sizeof (*writer));
+    struct os_ext_writer_file *file = malloc (sizeof (*file));
+
+    if (__builtin_expect (!file, 0))
+    {
+        fprintf (stderr, "memory allocation error for writer\n");
+        abort ();
+    }
+
+    *file = (struct os_ext_writer_file)
+    {
+        .fd = fd,
+    };
+
+    writer->file = file;
+    writer->use_ring = 0;
+    writer->pos = 0;
+    writer->iov_count = 0;
+    writer->iov_bytes = 0;
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+    writer->use_ring = use_ring;
+#else
+    (void) use_ring;
+#endif
+
+    luaL_setmetatable (L, OS_EXT_WRITER_TNAME);
+    lua_createtable (L, os_ext_writer_max_iov, 0);
+    lua_setuservalue (L, -2);
+
+    return 1;
+}
+
+static int
+os_ext_writer_write (lua_State *L)
+{
+    // like file:write() for strings, returns the writer
+
+    struct os_ext_writer *writer = check_open_writer (L);
+    int top = lua_gettop (L);
+
+    lua_getuservalue (L, 1);
+
+    for (int i = 2; i <= top; ++i)
+    {
+        size_t len;
+        const char *str = luaL_checklstring (L, i, &len);
+
+        if (!len) continue;
+
+        if (writer->iov_count == os_ext_writer_max_iov)
+        {
+            lua_pop (L, 1);
+            flush_writer (L, writer);
+            lua_getuservalue (L, 1);
+        }
+
+        writer->iov[writer->iov_count] = (struct iovec)
+        {
+            .iov_base = (void *) str,
+            .iov_len = len,
+        };
+        ++writer->iov_count;
+        writer->iov_bytes += len;
+
+        lua_pushvalue (L, i);
+        lua_rawseti (L, -2, writer->iov_count);
+    }
+
+    lua_pop (L, 1);
+
+    if (writer->iov_bytes >= os_ext_writer_flush_size)
+    {
+        flush_writer (L, writer);
+    }
+
+    lua_settop (L, 1);
+
+    return 1;
+}
+
+static int
+os_ext_writer_close (lua_State *L)
+{
+    // with io_uring the file is closed by its last write in flight
+
+    struct os_ext_writer *writer = luaL_checkudata (L, 1, OS_EXT_WRITER_TNAME);
+
+    if (!writer->file) return 0;
+
+    struct os_ext_writer_file *file = writer->file;
+    int is_gc = lua_toboolean (L, lua_upvalueindex (1));
+
+    if (!is_gc) flush_writer (L, writer);
+
+    writer->file = 0;
+    file->is_closed = 1;
+    release_file (file);
+
+    return 0;
+}
+
+static int
+os_ext_wait_writers (lua_State *L)
+{
+    // waits for the writes in flight, returns true or nil and the first
+    // error of them
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+    if (lua_getfield (L, LUA_REGISTRYINDEX, OS_EXT_RING_TNAME)
+            == LUA_TUSERDATA)
+    {
+        struct os_ext_ring *ring = lua_touserdata (L, -1);
+
+        check_wait_ring (L, ring, 0);
+
+        if (ring->err[0])
+        {
+            lua_pushnil (L);
+            lua_pushstring (L, ring->err);
+            ring->err[0] = 0;
+
+            return 2;
+        }
+    }
+#endif
+
+    lua_pushboolean (L, 1);
+
+    return 1;
+}
+
+static int
+os_ext_max_open_files (lua_State *L)
+{
+    // the soft limit of open files of the process, nil if there's no limit
+
+    struct rlimit rl;
+
+    if (getrlimit (RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY)
+    {
+        lua_pushnil (L);
+
+        return 1;
+    }
+
+    lua_pushinteger (L, rl.rlim_cur);
+
+    return 1;
+}
+
+static int
+os_ext_map_file (lua_State *L)
+{
+    // maps the file for sequential reading. the map mimics a read only file
+    // (read, seek, close), and additionally it gives slices without syscalls
+
+    const char *path = luaL_checkstring (L, 1);
+    const char *err_msg = 0;
+    struct stat st;
+
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) goto error;
+    if (fstat (fd, &st)) goto error;
+
+    if (!S_ISREG (st.st_mode))
+    {
+        // pipes and devices could not be mapped, the caller reads them
+        // in usual way
+
+        err_msg = "not a regular file";
+        goto error;
+    }
+
+    const char *data = 0;
+
+    if (st.st_size)
+    {
+        data = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data == MAP_FAILED) goto error;
+
+        madvise ((void *) data, st.st_size, MADV_SEQUENTIAL);
+        posix_fadvise (fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    }
+
+    struct os_ext_map *map = lua_newuserdata (L, sizeof (*map));
+
+    *map = (struct os_ext_map)
+    {
+        .data = data,
+        .size = st.st_size,
+        .fd = fd,
+    };
+
+    luaL_setmetatable (L, OS_EXT_MAP_TNAME);
+
+    return 1;
+
+error:
+    if (!err_msg) err_msg = strerror_l (errno, 0);
+
+    lua_pushnil (L);
+    lua_pushfstring (L, "%s: %s", path, err_msg);
+
+    if (fd != -1) close (fd);
+
+    return 2;
+}
+
+static struct os_ext_map *
+check_open_map (lua_State *L)
+{
+    struct os_ext_map *map = luaL_checkudata (L, 1, OS_EXT_MAP_TNAME);
+
+    if (__builtin_expect (map->fd == -1, 0))
+    {
+        luaL_error (L, "attempt to use a closed map");
+    }
+
+    return map;
+}
+
+static int
+os_ext_map_read (lua_State *L)
+{
+    struct os_ext_map *map = check_open_map (L);
+    long rest = map->size - map->pos;
+    long n;
+
+    if (lua_isinteger (L, 2))
+    {
+        n = lua_tointeger (L, 2);
+        luaL_argcheck (L, n >= 0, 2, "negative size");
+
+        if (!rest && n)
+        {
+            lua_pushnil (L);
+
+            return 1;
+        }
+
+        if (n > rest) n = rest;
+    }
+    else
+    {
+        const char *fmt = luaL_optstring (L, 2, "a");
+
+        if (*fmt == '*') ++fmt;
+        luaL_argcheck (L, *fmt == 'a', 2, "only size or 'a' format");
+
+        n = rest;
+    }
+
+    lua_pushlstring (L, map->data + map->pos, n);
+    map->pos += n;
+
+    return 1;
+}
+
+static int
+os_ext_map_seek (lua_State *L)
+{
+    static const char *const whences[] = {"set", "cur", "end", 0};
+
+    struct os_ext_map *map = check_open_map (L);
+    int whence = luaL_checkoption (L, 2, "cur", whences);
+    lua_Integer offset = luaL_optinteger (L, 3, 0);
+    lua_Integer bases[] = {0, map->pos, map->size};
+
+    offset += bases[whence];
+
+    if (offset < 0 || offset > map->size)
+    {
+        lua_pushnil (L);
+        lua_pushstring (L, "invalid position in a map");
+
+        return 2;
+    }
+
+    map->pos = offset;
+    lua_pushinteger (L, offset);
+
+    return 1;
+}
+
+static int
+os_ext_map_size (lua_State *L)
+{
+    struct os_ext_map *map = check_open_map (L);
+
+    lua_pushinteger (L, map->size);
+
+    return 1;
+}
+
+static int
+os_ext_map_slice (lua_State *L)
+{
+    // like string.sub(), but for positive positions only
+
+    struct os_ext_map *map = check_open_map (L);
+    lua_Integer begin_pos = luaL_checkinteger (L, 2);
+    lua_Integer end_pos = luaL_optinteger (L, 3, map->size);
+
+    if (begin_pos < 1) begin_pos = 1;
+    if (end_pos > map->size) end_pos = map->size;
+
+    if (begin_pos > end_pos)
+    {
+        lua_pushliteral (L, "");
+    }
+    else
+    {
+        lua_pushlstring (L, map->data + begin_pos - 1,
+                end_pos - begin_pos + 1);
+    }
+
+    return 1;
+}
+
+static int
+os_ext_map_drop_behind (lua_State *L)
+{
+    // the caller tells that the bytes before offset will not be needed
+    // soon. they are still readable, but they are dropped from the
+    // process and from the page cache, so a huge dump does not evict
+    // everything else from the cache
+
+    struct os_ext_map *map = check_open_map (L);
+    lua_Integer offset = luaL_checkinteger (L, 2);
+
+    if (offset > map->size) offset = map->size;
+
+    long page_size = sysconf (_SC_PAGESIZE);
+    long limit = offset / page_size * page_size;
+
+    if (limit - map->dropped < os_ext_map_drop_step) return 0;
+
+    madvise ((void *) (map->data + map->dropped), limit - map->dropped,
+            MADV_DONTNEED);
+    posix_fadvise (map->fd, map->dropped, limit - map->dropped,
+            POSIX_FADV_DONTNEED);
+
+    map->dropped = limit;
+
+    return 0;
+}
+
+static int
+os_ext_map_close (lua_State *L)
+{
+    struct os_ext_map *map = luaL_checkudata (L, 1, OS_EXT_MAP_TNAME);
+
+    if (map->fd == -1) return 0;
+
+    if (map->data) munmap ((void *) map->data, map->size);
+    close (map->fd);
+
+    *map = (struct os_ext_map)
+    {
+        .fd = -1,
+    };
+
+    return 0;
+}
+
 static const luaL_Reg os_ext_reg[] =
 {
     {"mkdir", os_ext_mkdir},
+    {"map_file", os_ext_map_file},
+    {"max_open_files", os_ext_max_open_files},
+    {"open_dir", os_ext_open_dir},
+    {"open_writer", os_ext_open_writer},
+    {"wait_writers", os_ext_wait_writers},
     {0, 0},
 };
 
 int
 luaopen_os_ext (lua_State *L)
 {
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, OS_EXT_MAP_TNAME);
+    lua_setfield (L, -2, "__name");
+    lua_createtable (L, 0, 6);
+    lua_pushcfunction (L, os_ext_map_read);
+    lua_setfield (L, -2, "read");
+    lua_pushcfunction (L, os_ext_map_seek);
+    lua_setfield (L, -2, "seek");
+    lua_pushcfunction (L, os_ext_map_size);
+    lua_setfield (L, -2, "size");
+    lua_pushcfunction (L, os_ext_map_slice);
+    lua_setfield (L, -2, "slice");
+    lua_pushcfunction (L, os_ext_map_drop_behind);
+    lua_setfield (L, -2, "drop_behind");
+    lua_pushcfunction (L, os_ext_map_close);
+    lua_setfield (L, -2, "close");
+    lua_setfield (L, -2, "__index");
+    lua_pushcfunction (L, os_ext_map_close);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, OS_EXT_MAP_TNAME);
+
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, OS_EXT_DIR_TNAME);
+    lua_setfield (L, -2, "__name");
+    lua_createtable (L, 0, 2);
+    lua_pushcfunction (L, os_ext_dir_mkdir);
+    lua_setfield (L, -2, "mkdir");
+    lua_pushcfunction (L, os_ext_dir_close);
+    lua_setfield (L, -2, "close");
+    lua_setfield (L, -2, "__index");
+    lua_pushcfunction (L, os_ext_dir_close);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, OS_EXT_DIR_TNAME);
+
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, OS_EXT_WRITER_TNAME);
+    lua_setfield (L, -2, "__name");
+    lua_createtable (L, 0, 2);
+    lua_pushcfunction (L, os_ext_writer_write);
+    lua_setfield (L, -2, "write");
+    lua_pushboolean (L, 0);
+    lua_pushcclosure (L, os_ext_writer_close, 1);
+    lua_setfield (L, -2, "close");
+    lua_setfield (L, -2, "__index");
+
+    // the strings of an unclosed writer could be collected already,
+    // so it's closed without writing them
+
+    lua_pushboolean (L, 1);
+    lua_pushcclosure (L, os_ext_writer_close, 1);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, OS_EXT_WRITER_TNAME);
+
+#ifdef PG_DUMP_SPLITTER_IO_URING
+    lua_createtable (L, 0, 2);
+    lua_pushstring (L, OS_EXT_RING_TNAME);
+    lua_setfield (L, -2, "__name");
+    lua_pushcfunction (L, os_ext_ring_gc);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, OS_EXT_RING_TNAME);
+#endif
+
     luaL_newlib (L, os_ext_reg);
 
+#ifdef PG_DUMP_SPLITTER_IO_URING
+    lua_pushboolean (L, 1);
+#else
+    lua_pushboolean (L, 0);
+#endif
+    lua_setfield (L, -2, "has_io_uring");
+
     return 1;
 }
 
@@ -0,0 +1,15 @@
+// memory mapped file, shared by os_ext (which makes it) and lex (which
+// could lex directly from it)
+
+#define OS_EXT_MAP_TNAME "os_ext.map"
+
+struct os_ext_map
+{
+    const char *data;   // mapped file, 0 if the file is empty
+    long size;          // size of the file
+    long pos;           // cursor, 0 based just like in file:seek()
+    long dropped;       // pages before this offset are already dropped
+    int fd;             // file descriptor, -1 after closing
+};
+
+// vi:ts=4:sw=4:et
@@ -0,0 +1,442 @@
+// abort, malloc, calloc, realloc, free
+#include <stdlib.h>
+
+// strdup, strerror_l, memcpy
+#include <string.h>
+
+// fprintf, stderr
+#include <stdio.h>
+
+// pthread_create, pthread_join, pthread_mutex_*, pthread_cond_*
+#include <pthread.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// luaL_openlibs
+#include <lualib.h>
+
+#include "pg-dump-splitter.h"
+
+// jobs are run by a pool of worker threads, each thread has its own lua
+// state with the modules of pg_dump_splitter, it's made once for the
+// pool. a job is a call of a module's function with a string, nothing but
+// the strings is shared with the caller's state. the caller adds jobs to
+// the pool's queue and waits for them in any order
+
+#define PAR_JOBS_POOL_TNAME "par_jobs.pool"
+
+struct par_jobs_job
+{
+    char *data;             // input, freed by taking the job
+    size_t len;
+    char *err;              // error of the job, 0 if it's done well
+    int is_done;
+};
+
+struct par_jobs_pool
+{
+    char *module_name;
+    char *func_name;
+    long count;
+    long cap;
+    struct par_jobs_job *jobs;
+    long next;              // the next job to take
+    int is_closing;         // the workers leave the jobs left
+    long thread_count;
+    pthread_t *threads;
+    int *is_made;
+    int is_init;            // the mutex and the conditions are made
+    pthread_mutex_t mutex;
+    pthread_cond_t added;   // a job is added or the pool is closing
+    pthread_cond_t done;    // a job is done
+};
+
+static char *
+strdup_or_abort (const char *str)
+{
+    char *dup = strdup (str ? str : "(error object is not a string)");
+
+    if (__builtin_expect (!dup, 0))
+    {
+        fprintf (stderr, "memory allocation error for job error\n");
+        abort ();
+    }
+
+    return dup;
+}
+
+static int
+traceback_msgh (lua_State *L)
+{
+    const char *msg = lua_tostring (L, 1);
+
+    luaL_traceback (L, L, msg, 0);
+
+    return 1;
+}
+
+static int
+open_job_func (lua_State *L)
+{
+    // returns the function of the jobs
+
+    const struct par_jobs_pool *pool = lua_touserdata (L, 1);
+
+    open_pg_dump_splitter (L);
+
+    lua_getglobal (L, "require");
+    lua_pushstring (L, pool->module_name);
+    lua_call (L, 1, 1);
+    lua_getfield (L, -1, pool->func_name);
+
+    return 1;
+}
+
+static long
+take_job (struct par_jobs_pool *pool, char **data, size_t *len)
+{
+    // waits for a job, returns -1 if the pool is closing
+
+    pthread_mutex_lock (&pool->mutex);
+
+    while (pool->next == pool->count && !pool->is_closing)
+    {
+        pthread_cond_wait (&pool->added, &pool->mutex);
+    }
+
+    long job_i = -1;
+
+    if (!pool->is_closing)
+    {
+        job_i = pool->next++;
+        *data = pool->jobs[job_i].data;
+        *len = pool->jobs[job_i].len;
+        pool->jobs[job_i].data = 0;
+    }
+
+    pthread_mutex_unlock (&pool->mutex);
+
+    return job_i;
+}
+
+static void
+finish_job (struct par_jobs_pool *pool, long job_i, char *err)
+{
+    pthread_mutex_lock (&pool->mutex);
+
+    pool->jobs[job_i].err = err;
+    pool->jobs[job_i].is_done = 1;
+    pthread_cond_broadcast (&pool->done);
+
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+static void *
+work (void *arg)
+{
+    struct par_jobs_pool *pool = arg;
+    lua_State *L = luaL_newstate ();
+
+    if (__builtin_expect (!L, 0))
+    {
+        fprintf (stderr, "memory allocation error for lua state\n");
+        abort ();
+    }
+
+    luaL_openlibs (L);
+
+    lua_pushcfunction (L, traceback_msgh);
+    lua_pushcfunction (L, open_job_func);
+    lua_pushlightuserdata (L, pool);
+
+    int open_err = lua_pcall (L, 1, 1, 1); // returns var: job function
+
+    for (;;)
+    {
+        char *data;
+        size_t len;
+        long job_i = take_job (pool, &data, &len);
+
+        if (job_i == -1) break;
+
+        char *err = 0;
+
+        if (open_err)
+        {
+            err = strdup_or_abort (lua_tostring (L, 2));
+        }
+        else
+        {
+            lua_pushvalue (L, 2);
+            lua_pushlstring (L, data, len);
+
+            if (lua_pcall (L, 1, 0, 1))
+            {
+                err = strdup_or_abort (lua_tostring (L, -1));
+            }
+
+            lua_settop (L, 2);
+        }
+
+        free (data);
+        finish_job (pool, job_i, err);
+    }
+
+    lua_close (L);
+
+    return 0;
+}
+
+static struct par_jobs_pool *
+check_open_pool (lua_State *L)
+{
+    struct par_jobs_pool *pool = luaL_checkudata (L, 1, PAR_JOBS_POOL_TNAME);
+
+    if (__builtin_expect (!pool->threads, 0))
+    {
+        luaL_error (L, "attempt to use a closed pool of jobs");
+    }
+
+    return pool;
+}
+
+static int
+par_jobs_pool_close (lua_State *L)
+{
+    // the workers leave the jobs which aren't taken yet
+
+    struct par_jobs_pool *pool = luaL_checkudata (L, 1, PAR_JOBS_POOL_TNAME);
+
+    if (pool->threads)
+    {
+        pthread_mutex_lock (&pool->mutex);
+        pool->is_closing = 1;
+        pthread_cond_broadcast (&pool->added);
+        pthread_mutex_unlock (&pool->mutex);
+
+        for (long i = 0; i < pool->thread_count; ++i)
+        {
+            if (pool->is_made[i]) pthread_join (pool->threads[i], 0);
+        }
+    }
+
+    if (pool->is_init)
+    {
+        pthread_cond_destroy (&pool->done);
+        pthread_cond_destroy (&pool->added);
+        pthread_mutex_destroy (&pool->mutex);
+    }
+
+    for (long i = 0; i < pool->count; ++i)
+    {
+        free (pool->jobs[i].data);
+        free (pool->jobs[i].err);
+    }
+
+    free (pool->jobs);
+    free (pool->is_made);
+    free (pool->threads);
+    free (pool->func_name);
+    free (pool->module_name);
+    *pool = (struct par_jobs_pool) {};
+
+    return 0;
+}
+
+static int
+par_jobs_start (lua_State *L)
+{
+    // args: thread_count, module_name, func_name.
+    // returns a pool of worker threads, or nil and an error if no thread
+    // could be made
+
+    lua_Integer thread_count = luaL_checkinteger (L, 1);
+    const char *module_name = luaL_checkstring (L, 2);
+    const char *func_name = luaL_checkstring (L, 3);
+
+    if (thread_count < 1) thread_count = 1;
+
+    struct par_jobs_pool *pool = lua_newuserdata (L, sizeof (*pool));
+
+    *pool = (struct par_jobs_pool) {};
+    luaL_setmetatable (L, PAR_JOBS_POOL_TNAME);
+
+    pool->module_name = strdup_or_abort (module_name);
+    pool->func_name = strdup_or_abort (func_name);
+    pool->thread_count = thread_count;
+    pool->threads = calloc (thread_count, sizeof (*pool->threads));
+    pool->is_made = calloc (thread_count, sizeof (*pool->is_made));
+
+    if (__builtin_expect (!pool->threads || !pool->is_made, 0))
+    {
+        fprintf (stderr, "memory allocation error for threads\n");
+        abort ();
+    }
+
+    pthread_mutex_init (&pool->mutex, 0);
+    pthread_cond_init (&pool->added, 0);
+    pthread_cond_init (&pool->done, 0);
+    pool->is_init = 1;
+
+    // if a thread could not be made, the others take its jobs
+
+    int made_count = 0;
+    int err = 0;
+
+    for (lua_Integer i = 0; i < thread_count; ++i)
+    {
+        int thread_err = pthread_create (&pool->threads[i], 0, work, pool);
+
+        pool->is_made[i] = !thread_err;
+
+        if (thread_err) err = thread_err;
+        else ++made_count;
+    }
+
+    if (!made_count)
+    {
+        lua_pushcfunction (L, par_jobs_pool_close);
+        lua_pushvalue (L, -2);
+        lua_call (L, 1, 0);
+
+        lua_pushnil (L);
+        lua_pushfstring (L, "pthread_create: %s", strerror_l (err, 0));
+
+        return 2;
+    }
+
+    return 1;
+}
+
+static int
+par_jobs_pool_add (lua_State *L)
+{
+    // args: pool, input. returns the index of the job
+
+    struct par_jobs_pool *pool = check_open_pool (L);
+    size_t len;
+    const char *input = luaL_checklstring (L, 2, &len);
+    char *data = malloc (len ? len : 1);
+
+    if (__builtin_expect (!data, 0))
+    {
+        fprintf (stderr, "memory allocation error for job input\n");
+        abort ();
+    }
+
+    memcpy (data, input, len);
+
+    pthread_mutex_lock (&pool->mutex);
+
+    if (pool->count == pool->cap)
+    {
+        long cap = pool->cap ? pool->cap * 2 : 64;
+        struct par_jobs_job *jobs = realloc (pool->jobs,
+                cap * sizeof (*jobs));
+
+        if (__builtin_expect (!jobs, 0))
+        {
+            fprintf (stderr, "memory allocation error for jobs\n");
+            abort ();
+        }
+
+        pool->jobs = jobs;
+        pool->cap = cap;
+    }
+
+    long job_i = pool->count++;
+
+    pool->jobs[job_i] = (struct par_jobs_job)
+    {
+        .data = data,
+        .len = len,
+    };
+    pthread_cond_signal (&pool->added);
+
+    pthread_mutex_unlock (&pool->mutex);
+
+    lua_pushinteger (L, job_i + 1);
+
+    return 1;
+}
+
+static int
+par_jobs_pool_wait (lua_State *L)
+{
+    // args: pool, job index, is_polled. returns true and the job's error
+    // (nil if it's done well). if is_polled, returns false at once for
+    // a job which isn't done
+
+    struct par_jobs_pool *pool = check_open_pool (L);
+    lua_Integer job_n = luaL_checkinteger (L, 2);
+    int is_polled = lua_toboolean (L, 3);
+
+    luaL_argcheck (L, job_n >= 1 && job_n <= pool->count, 2,
+            "no such job");
+
+    // jobs are added by the caller only, so the job stays in place
+
+    struct par_jobs_job *job = &pool->jobs[job_n - 1];
+
+    pthread_mutex_lock (&pool->mutex);
+
+    while (!job->is_done && !is_polled)
+    {
+        pthread_cond_wait (&pool->done, &pool->mutex);
+    }
+
+    int is_done = job->is_done;
+    char *err = job->err;
+
+    job->err = 0;
+
+    pthread_mutex_unlock (&pool->mutex);
+
+    lua_pushboolean (L, is_done);
+
+    if (!is_done) return 1;
+
+    if (err)
+    {
+        lua_pushstring (L, err);
+        free (err);
+    }
+    else
+    {
+        lua_pushnil (L);
+    }
+
+    return 2;
+}
+
+static const luaL_Reg par_jobs_reg[] =
+{
+    {"start", par_jobs_start},
+    {0, 0},
+};
+
+int
+luaopen_par_jobs (lua_State *L)
+{
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, PAR_JOBS_POOL_TNAME);
+    lua_setfield (L, -2, "__name");
+    lua_createtable (L, 0, 3);
+    lua_pushcfunction (L, par_jobs_pool_add);
+    lua_setfield (L, -2, "add");
+    lua_pushcfunction (L, par_jobs_pool_wait);
+    lua_setfield (L, -2, "wait");
+    lua_pushcfunction (L, par_jobs_pool_close);
+    lua_setfield (L, -2, "close");
+    lua_setfield (L, -2, "__index");
+    lua_pushcfunction (L, par_jobs_pool_close);
+    lua_setfield (L, -2, "__gc");
+    lua_setfield (L, LUA_REGISTRYINDEX, PAR_JOBS_POOL_TNAME);
+
+    luaL_newlib (L, par_jobs_reg);
+
+    return 1;
+}
+
+// vi:ts=4:sw=4:et
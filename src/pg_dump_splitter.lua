@@ -2,6 +2,8 @@ local std, _ENV = _ENV
 
 local lex = std.require 'lex'
 local os_ext = std.require 'os_ext'
+-- par_jobs is missing if threads aren't built in (MS Windows API)
+local par_jobs = std.package.loaded.par_jobs or {}
 local sort_chunks = std.require 'sort_chunks'
 local split_to_chunks = std.require 'split_to_chunks'
 
@@ -13,15 +15,29 @@ function export.make_default_options(options)
     io_size = 128 * 1024,
     lex_trans_more = false,
     lexemes_in_pt_ctx = false,
+    native_matcher = true,
+    max_pt_states = 10000,
+    shape_cache_size = 10000,
+    profile_path = false,
+    profile_top = 20,
     save_unprocessed = false,
     no_schema_dirs = false,
     relaxed_order = false,
     split_stateless = false,
+    chunk_buffer_size = 64 * 1024 * 1024,
+    max_chunk_handles = false,
+    jobs = 1,
+    io_uring = os_ext.has_io_uring or false,
     sql_footer = '-- v' .. 'i:ts=2:sw=2:et',
     lex_consts = lex.consts,
+    lex_translate = lex.translate,
     make_lex_ctx = lex.make_ctx,
     open = std.io.open,
-    tmpfile = std.io.tmpfile,
+    map_file = os_ext.map_file,
+    max_open_files = os_ext.max_open_files,
+    open_dir = os_ext.open_dir,
+    open_writer = os_ext.open_writer,
+    wait_writers = os_ext.wait_writers,
     mkdir = os_ext.mkdir,
     remove = std.os.remove,
     rename = std.os.rename,
@@ -36,11 +52,16 @@ function export.make_default_options(options)
         split_to_chunks.make_options_from_pg_dump_splitter,
     make_sort_chunk_options =
         sort_chunks.make_options_from_pg_dump_splitter,
+    make_chunk_buckets = sort_chunks.make_chunk_buckets,
+    make_chunk_dirs = sort_chunks.make_chunk_dirs,
     add_to_chunk = sort_chunks.add_to_chunk,
     make_sort_rules = sort_chunks.make_sort_rules,
     make_pattern_rules = split_to_chunks.make_pattern_rules,
+    prepare_pattern_rules = split_to_chunks.prepare_pattern_rules,
     split_to_chunks = split_to_chunks.split_to_chunks,
     sort_chunk = sort_chunks.sort_chunk,
+    pack_sort_job = sort_chunks.pack_sort_job,
+    start_par_jobs = par_jobs.start or false,
   }
 end
 
@@ -81,7 +102,8 @@ function export.chunks_ctx_proto:add(obj_type, obj_values, dump_data)
   local raw_path, ready_path = self.options.add_to_chunk(
       self.output_dir, directories, filename, order,
       state_keys, self.state_mem, dump_data,
-      self.options:make_add_to_chunk_options())
+      self.splitter_ctx.add_to_chunk_options, self.chunk_buckets,
+      self.chunk_dirs)
 
   if self.hooks_ctx.added_to_chunk_handler then
     self.hooks_ctx:added_to_chunk_handler(obj_type, obj_values,
@@ -90,11 +112,26 @@ function export.chunks_ctx_proto:add(obj_type, obj_values, dump_data)
         raw_path, ready_path)
   end
 
-  local buf = ('ss'):pack(raw_path, ready_path)
-  self.paths_fd:write(('j'):pack(#buf), buf)
+  self:register_path(raw_path, ready_path)
 end
 
-function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
+function export.chunks_ctx_proto:register_path(raw_path, ready_path)
+  -- each chunk is sorted once, in the order of first adding to it
+
+  if self.raw_paths[ready_path] then return end
+
+  self.raw_paths[ready_path] = raw_path
+  std.table.insert(self.ready_paths, ready_path)
+end
+
+export.splitter_ctx_proto = {}
+
+function export.make_splitter_ctx(hooks_path, options)
+  -- everything which doesn't depend on a dump: the hooks, the rules and
+  -- the options of the steps. the context splits any number of dumps then.
+  -- split_dump() makes and prepares the rules again for each dump if
+  -- begin_split_to_chunks_handler could edit them
+
   local hooks_ctx = {}
 
   if hooks_path then
@@ -108,9 +145,140 @@ function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
     hooks_ctx:options_handler(options)
   end
 
+  local splitter_ctx = std.setmetatable(
+    {
+      hooks_ctx = hooks_ctx,
+      options = options,
+      add_to_chunk_options = options:make_add_to_chunk_options(),
+      split_to_chunks_options = options:make_split_to_chunks_options(),
+      sort_chunk_options = options:make_sort_chunk_options(),
+      sort_rules = options.make_sort_rules(
+          options:make_sort_rules_options()),
+      pattern_rules = options.make_pattern_rules(
+          options:make_pattern_rules_options()),
+    },
+    {__index = export.splitter_ctx_proto}
+  )
+
+  splitter_ctx.prepared = options.prepare_pattern_rules(
+      splitter_ctx.pattern_rules, splitter_ctx.split_to_chunks_options)
+
+  return splitter_ctx
+end
+
+export.buffer_fd_proto = {}
+
+function export.make_buffer_fd(data)
+  -- a dump in memory, it mimics a read only file (read, seek, close)
+
+  return std.setmetatable({data = data, pos = 0},
+      {__index = export.buffer_fd_proto})
+end
+
+function export.buffer_fd_proto:read(n)
+  if self.pos >= #self.data then return nil end
+
+  local buf = self.data:sub(self.pos + 1, self.pos + n)
+  self.pos = self.pos + #buf
+
+  return buf
+end
+
+function export.buffer_fd_proto:seek(whence, offset)
+  local base = 0
+
+  if whence == 'cur' or whence == nil then
+    base = self.pos
+  elseif whence == 'end' then
+    base = #self.data
+  end
+
+  self.pos = base + (offset or 0)
+
+  return self.pos
+end
+
+function export.buffer_fd_proto:close()
+  self.data = ''
+  self.pos = 0
+end
+
+function export.splitter_ctx_proto:split(dump_path, output_dir)
+  self:split_dump(dump_path, output_dir, function()
+    local dump_fd
+
+    if self.options.map_file then
+      -- nil if the dump could not be mapped, it is read in usual way then
+
+      dump_fd = self.options.map_file(dump_path)
+    end
+
+    if not dump_fd then
+      dump_fd = std.assert(self.options.open(dump_path, 'rb'))
+    end
+
+    return dump_fd
+  end)
+end
+
+function export.splitter_ctx_proto:split_buffer(data, output_dir)
+  -- the hooks get no dump_path for a dump in memory
+
+  self:split_dump(nil, output_dir, function()
+    return export.make_buffer_fd(data)
+  end)
+end
+
+-- chunks queued for worker threads, per thread. the hooks get a chunk
+-- when the chunks before it are sorted, so a big chunk holds the others
+-- back no more than this
+export.sort_jobs_per_thread = 8
+
+function export.splitter_ctx_proto:finish_sort_jobs(sort_pool, sort_queue,
+    max_count)
+  -- the sorted chunks are given to the hooks in the same order as they
+  -- would get them from sorting one by one. the done jobs at the queue's
+  -- head are finished, then the queue is waited for till no more than
+  -- max_count jobs are left in it
+
+  local hooks_ctx = self.hooks_ctx
+
+  while sort_queue.first <= sort_queue.last do
+    local sort_job = sort_queue[sort_queue.first]
+    local is_done, err = sort_pool:wait(sort_job.job_i,
+        sort_queue.last - sort_queue.first < max_count)
+
+    if not is_done then return end
+    if err then std.error(err, 0) end
+
+    sort_queue[sort_queue.first] = nil
+    sort_queue.first = sort_queue.first + 1
+
+    if hooks_ctx.sorted_chunk_handler then
+      hooks_ctx:sorted_chunk_handler(sort_job.raw_path, sort_job.ready_path)
+    end
+  end
+end
+
+function export.splitter_ctx_proto:wait_writers()
+  -- the ready files written by io_uring are complete after it
+
+  local options = self.options
+
+  if options.io_uring and options.wait_writers then
+    std.assert(options.wait_writers())
+  end
+end
+
+function export.splitter_ctx_proto:split_dump(dump_path, output_dir,
+    open_dump)
+  local hooks_ctx = self.hooks_ctx
+  local options = self.options
   local lex_ctx
   local dump_fd
-  local paths_fd
+  local chunk_buckets
+  local chunk_dirs
+  local sort_pool
 
   local ok, err = std.xpcall(function()
     if hooks_ctx.begin_program_handler then
@@ -126,8 +294,8 @@ function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
     std.assert(tmp_output_dir, 'no tmp_output_dir')
 
     lex_ctx = options.make_lex_ctx(options.lex_max_size)
-    dump_fd = std.assert(options.open(dump_path, 'rb'))
-    paths_fd = std.assert(options.tmpfile())
+    dump_fd = open_dump()
+
     std.assert(options.mkdir(tmp_output_dir))
 
     if hooks_ctx.made_output_dir_handler then
@@ -135,69 +303,104 @@ function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
     end
 
     local state_mem = {}
-
-    local sort_rules = options.make_sort_rules(
-        options:make_sort_rules_options())
-
-    local pattern_rules = options.make_pattern_rules(
-        options:make_pattern_rules_options())
+    chunk_buckets = options.make_chunk_buckets(
+        self.add_to_chunk_options)
+    chunk_dirs = options.make_chunk_dirs(tmp_output_dir,
+        self.add_to_chunk_options)
 
     local chunks_ctx = std.setmetatable(
       {
         state_mem = state_mem,
-        sort_rules = sort_rules,
+        sort_rules = self.sort_rules,
         output_dir = tmp_output_dir,
         hooks_ctx = hooks_ctx,
         options = options,
-        paths_fd = paths_fd,
+        splitter_ctx = self,
+        raw_paths = {}, -- by ready paths
+        ready_paths = {},
+        chunk_buckets = chunk_buckets,
+        chunk_dirs = chunk_dirs,
       },
       {__index = export.chunks_ctx_proto}
     )
 
+    local pattern_rules = self.pattern_rules
+    local prepared = self.prepared
+
     if hooks_ctx.begin_split_to_chunks_handler then
+      -- the handler could edit the rules, so it gets fresh ones for each
+      -- dump, they are prepared after it
+
+      pattern_rules = options.make_pattern_rules(
+          options:make_pattern_rules_options())
+
       hooks_ctx:begin_split_to_chunks_handler(lex_ctx, dump_fd,
           pattern_rules, chunks_ctx)
+
+      prepared = options.prepare_pattern_rules(pattern_rules,
+          self.split_to_chunks_options)
     end
 
     options.split_to_chunks(lex_ctx, dump_fd,
         pattern_rules, chunks_ctx, hooks_ctx,
-        options:make_split_to_chunks_options())
+        self.split_to_chunks_options, prepared)
 
     if hooks_ctx.end_split_to_chunks_handler then
       hooks_ctx:end_split_to_chunks_handler()
     end
 
-    paths_fd:seek('set', 0)
+    -- the raw files are flushed before sorting
+
+    chunk_buckets:close_handles()
 
     if hooks_ctx.begin_sort_chunks_handler then
       hooks_ctx:begin_sort_chunks_handler(tmp_output_dir)
     end
 
-    while true do
-      local buf = paths_fd:read(('j'):packsize())
+    -- with several jobs the chunks are sorted by one pool of worker
+    -- threads for the whole phase. it's sequential if no thread is made
 
-      if not buf then break end
-
-      buf = paths_fd:read((('j'):unpack(buf)))
-      local raw_path, ready_path = ('ss'):unpack(buf)
-
-      local ready_fd = options.open(ready_path, 'rb')
-
-      if ready_fd then
-        ready_fd:close()
-        goto sort_continue
-      end
-
-      options.sort_chunk(raw_path, ready_path,
-          options:make_sort_chunk_options())
+    if options.jobs > 1 and options.start_par_jobs then
+      sort_pool = options.start_par_jobs(options.jobs, 'sort_chunks',
+          'sort_chunk_job')
+    end
 
-      if hooks_ctx.sorted_chunk_handler then
-        hooks_ctx:sorted_chunk_handler(raw_path, ready_path)
+    -- jobs of the pool by their order, they wait for the hooks
+    local sort_queue = {first = 1, last = 0}
+    local max_queued = options.jobs * export.sort_jobs_per_thread
+
+    for i, ready_path in std.ipairs(chunks_ctx.ready_paths) do
+      local raw_path = chunks_ctx.raw_paths[ready_path]
+
+      if sort_pool then
+        sort_queue.last = sort_queue.last + 1
+        sort_queue[sort_queue.last] = {
+          raw_path = raw_path,
+          ready_path = ready_path,
+          job_i = sort_pool:add(options.pack_sort_job(raw_path, ready_path,
+              self.sort_chunk_options, chunk_buckets)),
+        }
+
+        self:finish_sort_jobs(sort_pool, sort_queue, max_queued)
+      else
+        options.sort_chunk(raw_path, ready_path, self.sort_chunk_options,
+            chunk_buckets)
+
+        if hooks_ctx.sorted_chunk_handler then
+          self:wait_writers()
+          hooks_ctx:sorted_chunk_handler(raw_path, ready_path)
+        end
       end
+    end
 
-      ::sort_continue::
+    if sort_pool then
+      self:finish_sort_jobs(sort_pool, sort_queue, 0)
+      sort_pool:close()
+      sort_pool = nil
     end
 
+    self:wait_writers()
+
     if hooks_ctx.end_sort_chunks_handler then
       hooks_ctx:end_sort_chunks_handler()
     end
@@ -212,13 +415,21 @@ function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
     end
   end, std.debug.traceback)
 
-  if paths_fd then paths_fd:close() end
+  if sort_pool then sort_pool:close() end
+  if chunk_buckets then chunk_buckets:close_handles() end
+  if chunk_dirs then chunk_dirs:close() end
   if dump_fd then dump_fd:close() end
   if lex_ctx then lex_ctx:free() end
 
   std.assert(ok, err)
 end
 
+function export.pg_dump_splitter(dump_path, output_dir, hooks_path, options)
+  local splitter_ctx = export.make_splitter_ctx(hooks_path, options)
+
+  splitter_ctx:split(dump_path, output_dir)
+end
+
 return export
 
 -- vi:ts=2:sw=2:et
@@ -0,0 +1,701 @@
+// abort, realloc, free
+#include <stdlib.h>
+
+// memcmp, memcpy, memset
+#include <string.h>
+
+// fprintf, stderr
+#include <stdio.h>
+
+#include "pt-match.h"
+
+static void *
+realloc_or_abort (void *p, long count, long size, const char *what)
+{
+    void *new_p = realloc (p, count * size);
+
+    if (__builtin_expect (!new_p, 0))
+    {
+        fprintf (stderr, "memory allocation error for %s\n", what);
+        abort ();
+    }
+
+    return new_p;
+}
+
+static int
+resolve_pc (const struct pt_match_prog *prog, int pc)
+{
+    // jumps aren't states: a state is pushed right at the jump's target,
+    // just like split_to_chunks pushes a rule list which goes on with
+    // the rest of the outer one
+
+    while (prog->code[pc].op == pt_match_op_jmp) pc = prog->code[pc].arg;
+
+    return pc;
+}
+
+static void
+append_state (struct pt_match_list *list, const struct pt_match_state *state)
+{
+    if (list->count == list->cap)
+    {
+        long cap = list->cap ? list->cap * 2 : 64;
+
+        list->states = realloc_or_abort (list->states, cap,
+                sizeof (*list->states), "matcher states");
+        list->cap = cap;
+    }
+
+    list->states[list->count++] = *state;
+}
+
+static unsigned long
+hash_state (const struct pt_match_state *state)
+{
+    // FNV-1a over the program counter and the link of values
+
+    unsigned long h = 2166136261u;
+
+    h = (h ^ (unsigned) state->pc) * 16777619u;
+    h = (h ^ (unsigned) state->link) * 16777619u;
+
+    return h;
+}
+
+static int
+is_same_state (const struct pt_match_state *a,
+        const struct pt_match_state *b)
+{
+    // equal values have the same link, see make_link()
+
+    return a->pc == b->pc && a->link == b->link;
+}
+
+static void
+put_to_slot (struct pt_match_set *set, long state_i)
+{
+    unsigned long mask = set->slot_count - 1;
+    unsigned long slot = hash_state (&set->states[state_i]) & mask;
+
+    while (set->slots[slot]) slot = (slot + 1) & mask;
+
+    set->slots[slot] = state_i + 1;
+}
+
+static int
+add_to_set (struct pt_match_set *set, const struct pt_match_state *state)
+{
+    // returns zero if the state is in the set already
+
+    if ((set->count + 1) * 2 > set->slot_count)
+    {
+        long slot_count = set->slot_count ? set->slot_count * 2 : 128;
+
+        set->slots = realloc_or_abort (set->slots, slot_count,
+                sizeof (*set->slots), "matcher state set");
+        set->slot_count = slot_count;
+        memset (set->slots, 0, slot_count * sizeof (*set->slots));
+
+        for (long i = 0; i < set->count; ++i) put_to_slot (set, i);
+    }
+
+    unsigned long mask = set->slot_count - 1;
+
+    for (unsigned long slot = hash_state (state) & mask;
+            set->slots[slot]; slot = (slot + 1) & mask)
+    {
+        if (is_same_state (&set->states[set->slots[slot] - 1], state))
+        {
+            return 0;
+        }
+    }
+
+    if (set->count == set->cap)
+    {
+        long cap = set->cap ? set->cap * 2 : 64;
+
+        set->states = realloc_or_abort (set->states, cap,
+                sizeof (*set->states), "matcher state set");
+        set->cap = cap;
+    }
+
+    set->states[set->count] = *state;
+    put_to_slot (set, set->count++);
+
+    return 1;
+}
+
+static void
+clear_set (struct pt_match_set *set)
+{
+    if (!set->count) return;
+
+    set->count = 0;
+    memset (set->slots, 0, set->slot_count * sizeof (*set->slots));
+}
+
+static void
+clear_link_slots (struct pt_match_run *run)
+{
+    if (!run->link_slots_used) return;
+
+    run->link_slots_used = 0;
+    memset (run->link_slots, 0,
+            run->link_slot_count * sizeof (*run->link_slots));
+}
+
+static int
+obj_of_pc (const struct pt_match_prog *prog, int pc)
+{
+    // patterns are laid out one after another
+
+    int obj = 0;
+
+    for (long i = 0; i < prog->start_count; ++i)
+    {
+        if (prog->starts[i] <= pc && prog->starts[i] >= prog->starts[obj])
+        {
+            obj = i;
+        }
+    }
+
+    return obj;
+}
+
+static int
+push_unique (struct pt_match_run *run, struct pt_match_list *list,
+        struct pt_match_set *seen, const struct pt_match_state *state)
+{
+    // returns nonzero if the lexeme makes too many states
+
+    if (!add_to_set (seen, state)) return 0;
+
+    if (run->max_states &&
+            run->next_seen.count + run->soon_seen.count > run->max_states)
+    {
+        run->too_many_obj = obj_of_pc (run->prog, state->pc);
+
+        return 1;
+    }
+
+    append_state (list, state);
+
+    return 0;
+}
+
+static int
+push_state (struct pt_match_run *run, struct pt_match_list *list,
+        struct pt_match_set *seen, const struct pt_match_state *state, int pc)
+{
+    struct pt_match_state next =
+    {
+        .pc = resolve_pc (run->prog, pc),
+        .link = state->link,
+    };
+
+    return push_unique (run, list, seen, &next);
+}
+
+static void
+swap_lists (struct pt_match_list *a, struct pt_match_list *b)
+{
+    struct pt_match_list t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+void
+pt_match_index_prog (struct pt_match_prog *prog)
+{
+    // indexes the patterns by their leading kw rules. a statement starts
+    // with the patterns of its first keyword and the patterns beginning
+    // with something else, in the order of the rules. the other patterns
+    // would die on the first lexeme anyway
+
+    long count = 1;
+
+    for (long i = 0; i < prog->start_count; ++i)
+    {
+        const struct pt_match_insn *insn = &prog->code[prog->starts[i]];
+
+        if (insn->op == pt_match_op_kw && insn->arg >= count)
+        {
+            count = insn->arg + 1;
+        }
+    }
+
+    long other_count = 0;
+
+    for (long i = 0; i < prog->start_count; ++i)
+    {
+        if (prog->code[prog->starts[i]].op != pt_match_op_kw) ++other_count;
+    }
+
+    prog->lead_kw_count = count;
+    prog->lead_offs = realloc_or_abort (0, count + 1,
+            sizeof (*prog->lead_offs), "matcher index");
+    prog->lead_starts = realloc_or_abort (0,
+            other_count * count + prog->start_count - other_count + 1,
+            sizeof (*prog->lead_starts), "matcher index");
+
+    long n = 0;
+
+    for (long kw_id = 0; kw_id < count; ++kw_id)
+    {
+        prog->lead_offs[kw_id] = n;
+
+        for (long i = 0; i < prog->start_count; ++i)
+        {
+            const struct pt_match_insn *insn = &prog->code[prog->starts[i]];
+
+            if (insn->op != pt_match_op_kw || insn->arg == kw_id)
+            {
+                prog->lead_starts[n++] = prog->starts[i];
+            }
+        }
+    }
+
+    prog->lead_offs[count] = n;
+}
+
+static void
+start_patterns (struct pt_match_run *run, const struct pt_match_lexeme *lx)
+{
+    // pushes the candidate patterns for the statement's first lexeme
+
+    const struct pt_match_prog *prog = run->prog;
+    long kw_id = 0;
+
+    if (lx->level == 1 && lx->kind == pt_match_kind_simple_ident &&
+            lx->kw_id < prog->lead_kw_count)
+    {
+        kw_id = lx->kw_id;
+    }
+
+    for (long i = prog->lead_offs[kw_id]; i < prog->lead_offs[kw_id + 1]; ++i)
+    {
+        struct pt_match_state state =
+        {
+            .pc = resolve_pc (prog, prog->lead_starts[i]),
+        };
+
+        append_state (&run->cur, &state);
+    }
+}
+
+void
+pt_match_begin (struct pt_match_run *run, const struct pt_match_prog *prog)
+{
+    // a new statement: the patterns are started by its first lexeme
+
+    run->prog = prog;
+    run->cur.count = 0;
+    run->cap_count = 0;
+    run->link_count = 0;
+    run->step_links = 0;
+    clear_link_slots (run);
+    run->bytes_len = 0;
+    run->step = 0;
+    run->peak_states = 0;
+    run->last_cap_step = -1;
+    run->dead = 0;
+    run->decided = 0;
+    run->dead_end_pos = 0;
+    run->obj = -1;
+    run->obj_priority = 0;
+}
+
+static int
+capture (struct pt_match_run *run, int op, const struct pt_match_lexeme *lx)
+{
+    // the lexeme is copied once even if many states capture it
+
+    if (run->last_cap_step == run->step) return run->last_cap;
+
+    if (run->cap_count == run->cap_cap)
+    {
+        long cap = run->cap_cap ? run->cap_cap * 2 : 16;
+
+        run->caps = realloc_or_abort (run->caps, cap, sizeof (*run->caps),
+                "matcher captures");
+        run->cap_cap = cap;
+    }
+
+    if (run->bytes_len + lx->len > run->bytes_cap)
+    {
+        long cap = run->bytes_cap ? run->bytes_cap : 256;
+
+        while (run->bytes_len + lx->len > cap) cap *= 2;
+
+        run->bytes = realloc_or_abort (run->bytes, cap, 1,
+                "matcher captured values");
+        run->bytes_cap = cap;
+    }
+
+    memcpy (run->bytes + run->bytes_len, lx->buf, lx->len);
+    run->caps[run->cap_count] = (struct pt_match_cap)
+    {
+        .op = op,
+        .subtype = lx->subtype,
+        .aux = lx->aux,
+        .off = run->bytes_len,
+        .len = lx->len,
+    };
+    run->bytes_len += lx->len;
+    run->last_cap_step = run->step;
+    run->last_cap = ++run->cap_count;
+
+    return run->last_cap;
+}
+
+static unsigned long
+hash_link (int key, int cap, int prev)
+{
+    // FNV-1a like hash_state()
+
+    unsigned long h = 2166136261u;
+
+    h = (h ^ (unsigned) key) * 16777619u;
+    h = (h ^ (unsigned) cap) * 16777619u;
+    h = (h ^ (unsigned) prev) * 16777619u;
+
+    return h;
+}
+
+static void
+put_link_to_slot (struct pt_match_run *run, long link_i)
+{
+    const struct pt_match_link *link = &run->links[link_i];
+    unsigned long mask = run->link_slot_count - 1;
+    unsigned long slot = hash_link (link->key, link->cap, link->prev) & mask;
+
+    while (run->link_slots[slot]) slot = (slot + 1) & mask;
+
+    run->link_slots[slot] = link_i + 1;
+    ++run->link_slots_used;
+}
+
+static int
+make_link (struct pt_match_run *run, int key, int cap, int prev)
+{
+    // a link equal to one made for the same lexeme is reused, so equal
+    // values of states always have the same link. links of other lexemes
+    // have other captures, so only the lexeme's links are in the slots
+
+    if ((run->link_slots_used + 1) * 2 > run->link_slot_count)
+    {
+        long slot_count = run->link_slot_count ?
+                run->link_slot_count * 2 : 128;
+
+        run->link_slots = realloc_or_abort (run->link_slots, slot_count,
+                sizeof (*run->link_slots), "matcher link set");
+        run->link_slot_count = slot_count;
+        run->link_slots_used = 0;
+        memset (run->link_slots, 0, slot_count * sizeof (*run->link_slots));
+
+        for (long i = run->step_links; i < run->link_count; ++i)
+        {
+            put_link_to_slot (run, i);
+        }
+    }
+
+    unsigned long mask = run->link_slot_count - 1;
+
+    for (unsigned long slot = hash_link (key, cap, prev) & mask;
+            run->link_slots[slot]; slot = (slot + 1) & mask)
+    {
+        const struct pt_match_link *link =
+                &run->links[run->link_slots[slot] - 1];
+
+        if (link->key == key && link->cap == cap && link->prev == prev)
+        {
+            return run->link_slots[slot];
+        }
+    }
+
+    if (run->link_count == run->link_cap)
+    {
+        long link_cap = run->link_cap ? run->link_cap * 2 : 64;
+
+        run->links = realloc_or_abort (run->links, link_cap,
+                sizeof (*run->links), "matcher links");
+        run->link_cap = link_cap;
+    }
+
+    run->links[run->link_count] = (struct pt_match_link) {key, cap, prev};
+    put_link_to_slot (run, run->link_count);
+
+    return ++run->link_count;
+}
+
+static int
+push_captured (struct pt_match_run *run, const struct pt_match_state *state,
+        const struct pt_match_insn *insn, const struct pt_match_lexeme *lx)
+{
+    struct pt_match_state next =
+    {
+        .pc = resolve_pc (run->prog, state->pc + 1),
+        .link = make_link (run, insn->arg, capture (run, insn->op, lx),
+                state->link),
+    };
+
+    return push_unique (run, &run->next, &run->next_seen, &next);
+}
+
+static int
+is_symbol (const struct pt_match_prog *prog, int symbol,
+        const struct pt_match_lexeme *lx)
+{
+    const struct pt_match_symbol *s = &prog->symbols[symbol];
+
+    return s->len == lx->len &&
+            !memcmp (prog->strings + s->off, lx->buf, lx->len);
+}
+
+static int
+finish_with (struct pt_match_run *run, const struct pt_match_state *state,
+        int obj, long priority)
+{
+    // the rule ``en``: the statement is matched by the pattern, unless
+    // another one with higher priority is matched too
+
+    if (run->obj != -1 && run->obj != obj && run->obj_priority == priority)
+    {
+        run->ambiguous_obj = obj;
+        run->ambiguous_priority = priority;
+
+        return 1;
+    }
+
+    if (run->obj == -1 || run->obj_priority < priority)
+    {
+        run->obj = obj;
+        run->obj_priority = priority;
+        // the last value of a key is the one put by the last rule
+
+        memset (run->obj_caps, 0, sizeof (run->obj_caps));
+
+        for (int i = state->link; i; i = run->links[i - 1].prev)
+        {
+            const struct pt_match_link *link = &run->links[i - 1];
+
+            if (!run->obj_caps[link->key]) run->obj_caps[link->key] = link->cap;
+        }
+    }
+
+    return 0;
+}
+
+static int
+is_decided (const struct pt_match_run *run)
+{
+    // every state is at ``{any}, {en}``: the statement's end is the only
+    // lexeme that changes something
+
+    const struct pt_match_prog *prog = run->prog;
+
+    for (long i = 0; i < run->cur.count; ++i)
+    {
+        int pc = run->cur.states[i].pc;
+
+        if (prog->code[pc].op != pt_match_op_any ||
+                prog->code[resolve_pc (prog, pc + 1)].op != pt_match_op_en)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+enum pt_match_result
+pt_match_step (struct pt_match_run *run, const struct pt_match_lexeme *lx,
+        int is_end)
+{
+    // moves the states over a lexeme
+
+    const struct pt_match_prog *prog = run->prog;
+    struct pt_match_list *next = &run->next;
+    struct pt_match_list *soon_next = &run->soon_next;
+    struct pt_match_set *next_seen = &run->next_seen;
+    struct pt_match_set *soon_seen = &run->soon_seen;
+    int top = lx->level == 1;
+
+    // lexemes are counted up to the statement's end, like split_to_chunks
+    // counts the ones it skips
+
+    if (run->dead || (run->decided && !is_end))
+    {
+        ++run->step;
+
+        return pt_match_ok;
+    }
+
+    if (!run->step) start_patterns (run, lx);
+
+    next->count = 0;
+    run->step_links = run->link_count;
+    clear_link_slots (run);
+    clear_set (next_seen);
+    clear_set (soon_seen);
+    swap_lists (&run->soon, &run->cur);
+
+    while (run->soon.count)
+    {
+        soon_next->count = 0;
+
+        for (long i = 0; i < run->soon.count; ++i)
+        {
+            const struct pt_match_state *state = &run->soon.states[i];
+            const struct pt_match_insn *insn = &prog->code[state->pc];
+            int pc = state->pc;
+            int too_many = 0;
+
+            switch (insn->op)
+            {
+                case pt_match_op_kw:
+                    if (top && lx->kind == pt_match_kind_simple_ident &&
+                            lx->kw_id == insn->arg)
+                    {
+                        too_many = push_state (run, next, next_seen, state,
+                                pc + 1);
+                    }
+                    break;
+
+                case pt_match_op_ss:
+                    if (top && lx->kind == pt_match_kind_special_symbols &&
+                            is_symbol (prog, insn->arg, lx))
+                    {
+                        too_many = push_state (run, next, next_seen, state,
+                                pc + 1);
+                    }
+                    break;
+
+                case pt_match_op_rs:
+                    if (top && lx->kind == pt_match_kind_random_symbols &&
+                            is_symbol (prog, insn->arg, lx))
+                    {
+                        too_many = push_state (run, next, next_seen, state,
+                                pc + 1);
+                    }
+                    break;
+
+                case pt_match_op_ident:
+                    if (top && (lx->kind == pt_match_kind_quoted_ident ||
+                            (lx->kind == pt_match_kind_simple_ident &&
+                            !(lx->kw_id && lx->kw_id <= prog->reserved_count))))
+                    {
+                        too_many = push_captured (run, state, insn, lx);
+                    }
+                    break;
+
+                case pt_match_op_str:
+                    if (top && lx->kind == pt_match_kind_string)
+                    {
+                        too_many = push_captured (run, state, insn, lx);
+                    }
+                    break;
+
+                case pt_match_op_op_ident:
+                    if (top && lx->kind == pt_match_kind_random_symbols)
+                    {
+                        too_many = push_captured (run, state, insn, lx);
+                    }
+                    break;
+
+                case pt_match_op_en:
+                    if (top && lx->kind == pt_match_kind_special_symbols &&
+                            lx->len == 1 && lx->buf[0] == ';' &&
+                            finish_with (run, state, insn->arg, insn->arg2))
+                    {
+                        return pt_match_ambiguous;
+                    }
+                    break;
+
+                case pt_match_op_any:
+                    too_many = push_state (run, soon_next, soon_seen, state,
+                            pc + 1) ||
+                            push_state (run, next, next_seen, state, pc);
+                    break;
+
+                case pt_match_op_fork:
+                    for (int k = 1; k <= insn->arg && !too_many; ++k)
+                    {
+                        too_many = push_state (run, soon_next, soon_seen,
+                                state, insn[k].arg);
+                    }
+                    break;
+
+                case pt_match_op_rep:
+                    too_many = push_state (run, soon_next, soon_seen, state,
+                            pc + 1) ||
+                            push_state (run, soon_next, soon_seen, state,
+                            insn->arg);
+                    break;
+
+                case pt_match_op_end:
+                    break;
+
+                default:
+                    fprintf (stderr, "unexpected program flow\n");
+                    abort ();
+            }
+
+            if (__builtin_expect (too_many, 0)) return pt_match_too_many;
+        }
+
+        swap_lists (&run->soon, soon_next);
+    }
+
+    swap_lists (&run->cur, next);
+    ++run->step;
+
+    if (run->cur.count > run->peak_states) run->peak_states = run->cur.count;
+
+    if (!run->cur.count && !is_end)
+    {
+        run->dead = 1;
+        run->dead_end_pos = lx->pos;
+    }
+    else
+    {
+        run->decided = is_decided (run);
+    }
+
+    return pt_match_ok;
+}
+
+void
+pt_match_free_run (struct pt_match_run *run)
+{
+    free (run->cur.states);
+    free (run->next.states);
+    free (run->soon.states);
+    free (run->soon_next.states);
+    free (run->next_seen.states);
+    free (run->next_seen.slots);
+    free (run->soon_seen.states);
+    free (run->soon_seen.slots);
+    free (run->caps);
+    free (run->links);
+    free (run->link_slots);
+    free (run->bytes);
+    *run = (struct pt_match_run) {};
+}
+
+void
+pt_match_free_prog (struct pt_match_prog *prog)
+{
+    free (prog->code);
+    free (prog->starts);
+    free (prog->lead_offs);
+    free (prog->lead_starts);
+    free (prog->symbols);
+    free (prog->obj_types);
+    free (prog->strings);
+    *prog = (struct pt_match_prog) {};
+}
+
+// vi:ts=4:sw=4:et
@@ -0,0 +1,190 @@
+// native matcher of pattern rules, the lexer runs it on each lexeme of
+// batches. the rules are compiled to a flat program by
+// split_to_chunks.compile_pattern_rules(). a state of the NFA is
+// a program counter plus values captured on its way, the states are
+// processed in the same order as split_to_chunks.process_pt_ctx() does it.
+// equal states are pushed once per lexeme, a duplicate would do nothing new.
+// captured values of states are linked lists sharing their tails, so
+// a state is pushed without copying its values
+
+enum
+{
+    pt_match_max_keys = 16,
+};
+
+// results of pt_match_step()
+
+enum pt_match_result
+{
+    pt_match_ok,
+    pt_match_ambiguous,     // see ambiguous_obj
+    pt_match_too_many,      // see too_many_obj
+};
+
+enum pt_match_op
+{
+    pt_match_op_end,        // end of pattern, the state is dropped
+    pt_match_op_kw,         // arg: keyword id
+    pt_match_op_ss,         // arg: symbol index
+    pt_match_op_rs,         // arg: symbol index
+    pt_match_op_ident,      // arg: key index
+    pt_match_op_str,        // arg: key index
+    pt_match_op_op_ident,   // arg: key index
+    pt_match_op_en,         // arg: object type index, arg2: priority
+    pt_match_op_any,
+    pt_match_op_fork,       // arg: number of following alt instructions
+    pt_match_op_alt,        // arg: start of alternative
+    pt_match_op_rep,        // arg: instruction after the repeated sequence
+    pt_match_op_jmp,        // arg: target, never a state
+};
+
+// what the matcher needs to know about a lexeme's type and subtype
+
+enum pt_match_kind
+{
+    pt_match_kind_other,
+    pt_match_kind_simple_ident,
+    pt_match_kind_quoted_ident,
+    pt_match_kind_string,
+    pt_match_kind_special_symbols,
+    pt_match_kind_random_symbols,
+};
+
+struct pt_match_insn
+{
+    int op;
+    int arg;
+    long arg2;
+};
+
+struct pt_match_symbol
+{
+    long off;
+    long len;
+};
+
+struct pt_match_prog
+{
+    long code_len;
+    struct pt_match_insn *code;
+    long start_count;
+    int *starts;            // first instructions of patterns
+    long lead_kw_count;     // leading keyword ids are below it
+    long *lead_offs;        // candidates of each leading keyword id
+    int *lead_starts;       // in lead_starts[lead_offs[id]..lead_offs[id+1]]
+    long symbol_count;
+    struct pt_match_symbol *symbols;
+    long obj_type_count;
+    struct pt_match_symbol *obj_types;
+    char *strings;          // symbols and object types
+    int key_count;
+    long reserved_count;    // keyword ids 1..reserved_count are reserved
+};
+
+struct pt_match_lexeme
+{
+    int kind;
+    int subtype;
+    long level;
+    long kw_id;
+    long aux;               // marker length of dollar string
+    long pos;               // position after the lexeme
+    const char *buf;
+    long len;
+};
+
+struct pt_match_cap
+{
+    int op;                 // which rule captured the value
+    int subtype;
+    long aux;
+    long off;               // value in pt_match_run.bytes
+    long len;
+};
+
+struct pt_match_link
+{
+    int key;
+    int cap;                // capture index, 1 based
+    int prev;               // link of values captured before, 0 if none
+};
+
+struct pt_match_state
+{
+    int pc;
+    int link;               // link of the last captured value, 1 based,
+                            // 0 if none
+};
+
+struct pt_match_list
+{
+    long count;
+    long cap;
+    struct pt_match_state *states;
+};
+
+struct pt_match_set
+{
+    long count;
+    long cap;
+    struct pt_match_state *states;
+    long slot_count;            // power of 2
+    long *slots;                // indexes of states plus 1, 0 if free
+};
+
+struct pt_match_run
+{
+    const struct pt_match_prog *prog;
+    struct pt_match_list cur;
+    struct pt_match_list next;
+    struct pt_match_list soon;
+    struct pt_match_list soon_next;
+    struct pt_match_set next_seen;  // states pushed for the next lexeme
+    struct pt_match_set soon_seen;  // and for the current one
+    long max_states;            // states pushed per lexeme, 0 if no limit
+    long cap_count;
+    long cap_cap;
+    struct pt_match_cap *caps;  // captures of the current statement
+    long link_count;
+    long link_cap;
+    struct pt_match_link *links; // values of states of the statement
+    long step_links;            // first link made for the current lexeme
+    long link_slot_count;       // power of 2
+    long *link_slots;           // indexes of the lexeme's links plus 1,
+                                // 0 if free
+    long link_slots_used;
+    long bytes_len;
+    long bytes_cap;
+    char *bytes;
+    long step;                  // lexemes of the statement so far
+    long peak_states;           // the most states alive after a lexeme
+    long last_cap_step;         // the current lexeme is already captured
+    int last_cap;               // as this capture
+    int dead;                   // no state is alive
+    int decided;                // the states wait for ``;`` only
+    long dead_end_pos;          // position after the lexeme killing them
+    int obj;                    // matched object type index, -1 if none
+    long obj_priority;
+    int obj_caps[pt_match_max_keys]; // capture indexes, 0 if none
+    int ambiguous_obj;          // object types making an ambiguity error
+    long ambiguous_priority;
+    int too_many_obj;           // object type of the state over the limit
+};
+
+void
+pt_match_index_prog (struct pt_match_prog *prog);
+
+void
+pt_match_free_prog (struct pt_match_prog *prog);
+
+void
+pt_match_begin (struct pt_match_run *run, const struct pt_match_prog *prog);
+
+enum pt_match_result
+pt_match_step (struct pt_match_run *run, const struct pt_match_lexeme *lx,
+        int is_end);
+
+void
+pt_match_free_run (struct pt_match_run *run);
+
+// vi:ts=4:sw=4:et
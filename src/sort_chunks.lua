@@ -1,5 +1,7 @@
 local std, _ENV = _ENV
 
+local os_ext = std.require 'os_ext'
+
 local export = {}
 
 function export.make_options_from_pg_dump_splitter(options)
@@ -13,6 +15,13 @@ function export.make_options_from_pg_dump_splitter(options)
     split_stateless = options.split_stateless,
     relaxed_order = options.relaxed_order,
     sql_footer = options.sql_footer,
+    chunk_buffer_size = options.chunk_buffer_size,
+    max_chunk_handles = options.max_chunk_handles,
+    max_open_files = options.max_open_files,
+    open_dir = options.open_dir,
+    open_writer = options.open_writer,
+    io_uring = options.io_uring,
+    wait_writers = options.wait_writers,
   }
 end
 
@@ -265,132 +274,628 @@ function export.make_sort_rules(options)
   return sort_rules
 end
 
-function export.add_to_chunk(output_dir, directories, filename, order,
-    state_keys, state_mem, dump_data, options)
-  local ready_path = output_dir
+-- approximate memory of a record besides its strings
+export.chunk_record_overhead = 128
 
-  for dir_i, dir in std.ipairs(directories) do
-    ready_path = ready_path .. '/' .. options.ident_str_to_file_str(dir)
+export.chunk_handles_proto = {}
+
+function export.make_chunk_handles(options)
+  -- raw files open for appending, the least recently used one is closed
+  -- (and so flushed) when too many are open. statements of an object come
+  -- in bursts, so its raw file is mostly open already
+
+  local max_count = options.max_chunk_handles
+
+  if not max_count then
+    -- a half of the limit of open files is left for everything else
+
+    local max_open_files = options.max_open_files and
+        options.max_open_files()
 
-    options.mkdir(ready_path)
+    max_count = std.math.min(512, (max_open_files or 256) // 2)
   end
 
-  ready_path = ready_path .. '/' ..
-      options.ident_str_to_file_str(filename) .. '.sql'
-  local raw_path = ready_path .. '.chunk'
-  local state_keyvalues = {}
-  local state_values = {}
+  local head = {}
+
+  head.prev = head
+  head.next = head
+
+  return std.setmetatable(
+    {
+      head = head, -- the most recently used one is head.next
+      by_path = {},
+      count = 0,
+      max_count = std.math.max(1, max_count),
+      options = options,
+    },
+    {__index = export.chunk_handles_proto}
+  )
+end
 
-  for i, state_key in std.ipairs(state_keys) do
-    local state_value = state_mem[state_key]
+function export.chunk_handles_proto:unlink(handle)
+  handle.prev.next = handle.next
+  handle.next.prev = handle.prev
+end
 
-    if state_value then
-      std.table.insert(state_keyvalues, state_key)
-      std.table.insert(state_values, state_value)
-    end
+function export.chunk_handles_proto:link_first(handle)
+  handle.prev = self.head
+  handle.next = self.head.next
+  self.head.next.prev = handle
+  self.head.next = handle
+end
+
+function export.chunk_handles_proto:get(raw_path)
+  local handle = self.by_path[raw_path]
+
+  if handle then
+    self:unlink(handle)
+    self:link_first(handle)
+
+    return handle.fd
+  end
+
+  if self.count >= self.max_count then
+    self:close(self.head.prev.raw_path)
+  end
+
+  handle = {
+    raw_path = raw_path,
+    fd = std.assert(self.options.open(raw_path, 'ab')),
+  }
+
+  self.by_path[raw_path] = handle
+  self.count = self.count + 1
+  self:link_first(handle)
+
+  return handle.fd
+end
+
+function export.chunk_handles_proto:close(raw_path)
+  local handle = self.by_path[raw_path]
+
+  if not handle then return end
+
+  self:unlink(handle)
+  self.by_path[raw_path] = nil
+  self.count = self.count - 1
+
+  std.assert(handle.fd:close())
+end
+
+function export.chunk_handles_proto:close_all()
+  while self.count > 0 do
+    self:close(self.head.next.raw_path)
+  end
+end
+
+export.chunk_buckets_proto = {}
+
+function export.make_chunk_buckets(options)
+  -- records of chunks are kept in memory by their raw paths, they are
+  -- appended to the raw files only when the memory budget is over. chunks
+  -- of a small dump never go to the raw files
+
+  return std.setmetatable(
+    {
+      buckets = {},
+      size = 0,
+      max_size = options.chunk_buffer_size or 0,
+      handles = export.make_chunk_handles(options),
+      -- ends of sorted runs in the raw files, by their raw paths
+      run_ends = {},
+    },
+    {__index = export.chunk_buckets_proto}
+  )
+end
+
+function export.chunk_record_size(record)
+  local size = export.chunk_record_overhead + #record[2]
+
+  for i, state_key in std.ipairs(record[3]) do
+    size = size + #state_key + #record[4][i]
+  end
+
+  return size
+end
+
+function export.is_record_before(a, b)
+  if a[1] < b[1] then return true end
+  if a[1] > b[1] then return false end
+
+  return a[2] < b[2]
+end
+
+function export.pack_chunk_record(record)
+  -- the record with its size in front of it
+
+  local state_keyvalues = std.table.move(record[4], 1, #record[4],
+      #record[3] + 1, std.table.move(record[3], 1, #record[3], 1, {}))
+  local buf = ('jsj' .. ('s'):rep(#state_keyvalues)):pack(record[1],
+      record[2], #state_keyvalues, std.table.unpack(state_keyvalues))
+
+  return ('j'):pack(#buf) .. buf
+end
+
+function export.unpack_chunk_record(buf, n)
+  local order, dump_data, state_value_count
+  order, dump_data, state_value_count, n = ('jsj'):unpack(buf, n)
+  local state_keyvalues = std.table.move(
+      std.table.pack(('s'):rep(state_value_count):unpack(buf, n)),
+      1, state_value_count, 1, {})
+  local state_keys = std.table.move(state_keyvalues,
+      1, #state_keyvalues / 2, 1, {})
+  local state_values = std.table.move(state_keyvalues,
+      #state_keys + 1, #state_keyvalues, 1, {})
+
+  return {order, dump_data, state_keys, state_values}
+end
+
+function export.write_chunk_records(raw_path, records, options,
+    chunk_handles)
+  -- appends the records to the raw file at once, returns their size.
+  -- the file is kept open if there are chunk_handles
+
+  local bufs = {}
+
+  for i, record in std.ipairs(records) do
+    std.table.insert(bufs, export.pack_chunk_record(record))
+  end
+
+  local data = std.table.concat(bufs)
+
+  if chunk_handles then
+    std.assert(chunk_handles:get(raw_path):write(data))
+
+    return #data
   end
-  std.table.move(state_values, 1, #state_values, #state_keyvalues + 1,
-      state_keyvalues)
 
   local chunk_fd
 
   local ok, err = std.xpcall(function()
     chunk_fd = std.assert(options.open(raw_path, 'ab'))
-    local buf = ('jsj' .. ('s'):rep(#state_keyvalues)):pack(order, dump_data,
-        #state_keyvalues, std.table.unpack(state_keyvalues))
-    chunk_fd:write(('j'):pack(#buf), buf)
+    chunk_fd:write(data)
   end, std.debug.traceback)
 
   if chunk_fd then chunk_fd:close() end
 
   std.assert(ok, err)
 
+  return #data
+end
+
+function export.chunk_buckets_proto:add(raw_path, record, options)
+  if self.max_size <= 0 then
+    export.write_chunk_records(raw_path, {record}, options, self.handles)
+
+    return
+  end
+
+  local bucket = self.buckets[raw_path]
+
+  if not bucket then
+    bucket = {records = {}, size = 0}
+    self.buckets[raw_path] = bucket
+  end
+
+  local size = export.chunk_record_size(record)
+
+  std.table.insert(bucket.records, record)
+  bucket.size = bucket.size + size
+  self.size = self.size + size
+
+  if self.size > self.max_size then self:spill(options) end
+end
+
+function export.chunk_buckets_proto:spill(options)
+  -- a bucket is appended as a sorted run, sort_chunk() merges the runs
+  -- of a raw file without reading all of them into memory
+
+  for raw_path, bucket in std.pairs(self.buckets) do
+    if not options.relaxed_order then
+      std.table.sort(bucket.records, export.is_record_before)
+    end
+
+    local size = export.write_chunk_records(raw_path, bucket.records,
+        options, self.handles)
+    local run_ends = self.run_ends[raw_path]
+
+    if not run_ends then
+      run_ends = {}
+      self.run_ends[raw_path] = run_ends
+    end
+
+    std.table.insert(run_ends, (run_ends[#run_ends] or 0) + size)
+  end
+
+  self.buckets = {}
+  self.size = 0
+end
+
+function export.chunk_buckets_proto:close_handles()
+  self.handles:close_all()
+end
+
+function export.chunk_buckets_proto:take(raw_path)
+  -- the records kept in memory, they follow the records of the raw file,
+  -- and the ends of the sorted runs of the raw file. the raw file is
+  -- closed, so it's flushed for reading
+
+  self.handles:close(raw_path)
+
+  local bucket = self.buckets[raw_path]
+  local run_ends = self.run_ends[raw_path]
+
+  self.run_ends[raw_path] = nil
+
+  if not bucket then return nil, run_ends end
+
+  self.buckets[raw_path] = nil
+  self.size = self.size - bucket.size
+
+  return bucket.records, run_ends
+end
+
+export.chunk_dirs_proto = {}
+
+function export.make_chunk_dirs(output_dir, options)
+  -- directories of chunks made in the run. each one is made once, relative
+  -- to the opened output directory if os_ext.open_dir() is there
+
+  return std.setmetatable(
+    {
+      output_dir = output_dir,
+      root = options.open_dir and options.open_dir(output_dir) or nil,
+      paths = {}, -- by the directory names joined by zero bytes
+      options = options,
+    },
+    {__index = export.chunk_dirs_proto}
+  )
+end
+
+function export.chunk_dirs_proto:get(directories)
+  -- the path of the directory, it's made with its parents if needed
+
+  local key = std.table.concat(directories, '\0')
+  local path = self.paths[key]
+
+  if path then return path end
+
+  local sub_key
+  local rel_path
+
+  path = self.output_dir
+
+  for dir_i, dir in std.ipairs(directories) do
+    local file_str = self.options.ident_str_to_file_str(dir)
+
+    sub_key = sub_key and sub_key .. '\0' .. dir or dir
+    rel_path = rel_path and rel_path .. '/' .. file_str or file_str
+    path = path .. '/' .. file_str
+
+    if not self.paths[sub_key] then
+      if self.root then
+        self.root:mkdir(rel_path)
+      else
+        self.options.mkdir(path)
+      end
+
+      self.paths[sub_key] = path
+    end
+  end
+
+  self.paths[key] = path
+
+  return path
+end
+
+function export.chunk_dirs_proto:close()
+  if self.root then self.root:close() end
+end
+
+function export.make_run_reader(chunk_fd, begin_pos, end_pos, block_size)
+  -- reads the records of a run by blocks. the runs of a raw file share
+  -- its handle, so the handle is sought before every block
+
+  local pos = begin_pos
+  local buf = ''
+  local buf_i = 1
+
+  local function fill(n)
+    -- makes n bytes ready at buf_i, false if the run is over
+
+    local rest = #buf - buf_i + 1
+
+    if rest >= n then return true end
+    if pos >= end_pos then return false end
+
+    local size = std.math.min(std.math.max(n - rest, block_size),
+        end_pos - pos)
+
+    std.assert(chunk_fd:seek('set', pos))
+
+    local more = chunk_fd:read(size)
+
+    if not more then
+      pos = end_pos
+
+      return false
+    end
+
+    pos = pos + #more
+    buf = buf:sub(buf_i) .. more
+    buf_i = 1
+
+    return #buf >= n
+  end
+
+  return function()
+    if not fill(('j'):packsize()) then return nil end
+
+    local size
+
+    size, buf_i = ('j'):unpack(buf, buf_i)
+
+    std.assert(fill(size), 'truncated chunk record')
+
+    local record = export.unpack_chunk_record(buf, buf_i)
+
+    buf_i = buf_i + size
+
+    return record
+  end
+end
+
+function export.add_to_chunk(output_dir, directories, filename, order,
+    state_keys, state_mem, dump_data, options, chunk_buckets, chunk_dirs)
+  local ready_path
+
+  if chunk_dirs then
+    ready_path = chunk_dirs:get(directories)
+  else
+    ready_path = output_dir
+
+    for dir_i, dir in std.ipairs(directories) do
+      ready_path = ready_path .. '/' .. options.ident_str_to_file_str(dir)
+
+      options.mkdir(ready_path)
+    end
+  end
+
+  ready_path = ready_path .. '/' ..
+      options.ident_str_to_file_str(filename) .. '.sql'
+  local raw_path = ready_path .. '.chunk'
+  local record_state_keys = {}
+  local record_state_values = {}
+
+  for i, state_key in std.ipairs(state_keys) do
+    local state_value = state_mem[state_key]
+
+    if state_value then
+      std.table.insert(record_state_keys, state_key)
+      std.table.insert(record_state_values, state_value)
+    end
+  end
+
+  local record = {order, dump_data, record_state_keys, record_state_values}
+
+  if chunk_buckets then
+    chunk_buckets:add(raw_path, record, options)
+  else
+    export.write_chunk_records(raw_path, {record}, options)
+  end
+
   return raw_path, ready_path
 end
 
-function export.sort_chunk (raw_path, ready_path, options)
+function export.sort_chunk (raw_path, ready_path, options, chunk_buckets)
   local chunk_fd
   local sql_fd
+  local records
+  local run_ends
+
+  if chunk_buckets then records, run_ends = chunk_buckets:take(raw_path) end
 
   local ok, err = std.xpcall(function()
-    chunk_fd = std.assert(options.open(raw_path, 'rb'))
-    sql_fd = std.assert(options.open(ready_path, 'wb'))
+    local open_err
+
+    chunk_fd, open_err = options.open(raw_path, 'rb')
+
+    -- the raw file is missing if all the records are in memory
+
+    if not records then std.assert(chunk_fd, open_err) end
+
+    -- a writer of os_ext gathers the small writes into writev() calls,
+    -- with io_uring they are still in flight after closing it, see
+    -- options.wait_writers()
+
+    if options.open_writer then
+      sql_fd = std.assert(options.open_writer(ready_path, options.io_uring))
+    else
+      sql_fd = std.assert(options.open(ready_path, 'wb'))
+    end
 
-    local sortable = {}
     local written_state_mem = {}
 
-    local function write_state_value_if_needed(state_keys, state_values,
-        write_func)
+    local function write_record(record)
+      local state_keys = record[3]
+      local state_values = record[4]
+
       for i, state_key in std.ipairs(state_keys) do
         local state_value = state_values[i]
 
         if written_state_mem[state_key] ~= state_value then
-          write_func(state_key, state_value)
+          sql_fd:write(state_value, '\n\n')
           written_state_mem[state_key] = state_value
         end
       end
+
+      sql_fd:write(record[2], '\n\n')
     end
 
-    while true do
-      local buf = chunk_fd:read(('j'):packsize())
-
-      if not buf then break end
-
-      buf = chunk_fd:read((('j'):unpack(buf)))
-      local order, dump_data, state_value_count, n = ('jsj'):unpack(buf)
-      local state_keyvalues = std.table.move(
-          std.table.pack(('s'):rep(state_value_count):unpack(buf, n)),
-          1, state_value_count, 1, {})
-      local state_keys = std.table.move(state_keyvalues,
-          1, #state_keyvalues / 2, 1, {})
-      local state_values = std.table.move(state_keyvalues,
-          #state_keys + 1, #state_keyvalues, 1, {})
-
-      if options.relaxed_order then
-        -- relaxed order lets us write data on fly.
-        -- therefore we don't insert to ``sortable``
-
-        write_state_value_if_needed(state_keys, state_values,
-            function(state_key, state_value)
-              sql_fd:write(state_value, '\n\n')
-            end)
-        sql_fd:write(dump_data, '\n\n')
-      else
-        std.table.insert(sortable,
-            {order, dump_data, state_keys, state_values})
+    local is_sorted = not options.relaxed_order and
+        (run_ends or not chunk_fd)
+    local readers = {}
+
+    if chunk_fd and is_sorted then
+      local block_size = std.math.max(4096, options.io_size // #run_ends)
+      local begin_pos = 0
+
+      for i, end_pos in std.ipairs(run_ends) do
+        std.table.insert(readers, export.make_run_reader(chunk_fd,
+            begin_pos, end_pos, block_size))
+        begin_pos = end_pos
       end
+    elseif chunk_fd then
+      std.table.insert(readers, export.make_run_reader(chunk_fd,
+          0, std.math.maxinteger, options.io_size))
     end
 
-    std.table.sort(sortable, function(a, b)
-      if a[1] < b[1] then return true end
-      if a[1] > b[1] then return false end
+    if records then
+      local record_i = 0
 
-      return a[2] < b[2]
-    end)
+      if is_sorted then
+        std.table.sort(records, export.is_record_before)
+      end
 
-    for i, v in std.ipairs(sortable) do
-      local dump_data = v[2]
-      local state_keys = v[3]
-      local state_values = v[4]
+      std.table.insert(readers, function()
+        record_i = record_i + 1
 
-      write_state_value_if_needed(state_keys, state_values,
-          function(state_key, state_value)
-            sql_fd:write(state_value, '\n\n')
-          end)
-      sql_fd:write(dump_data, '\n\n')
+        return records[record_i]
+      end)
+    end
+
+    if options.relaxed_order then
+      -- relaxed order lets us write data on fly
+
+      for i, reader in std.ipairs(readers) do
+        for record in reader do write_record(record) end
+      end
+    elseif is_sorted then
+      -- the sorted runs and the records in memory are merged. an earlier
+      -- run goes first for equal records
+
+      local heads = {}
+
+      for i, reader in std.ipairs(readers) do heads[i] = reader() end
+
+      while true do
+        local min_i
+
+        for i = 1, #readers do
+          if heads[i] and (not min_i or
+              export.is_record_before(heads[i], heads[min_i])) then
+            min_i = i
+          end
+        end
+
+        if not min_i then break end
+
+        write_record(heads[min_i])
+        heads[min_i] = readers[min_i]()
+      end
+    else
+      -- the raw file is written record by record, it's sorted in memory
+
+      local sortable = {}
+
+      for i, reader in std.ipairs(readers) do
+        for record in reader do std.table.insert(sortable, record) end
+      end
+
+      std.table.sort(sortable, export.is_record_before)
+
+      for i, record in std.ipairs(sortable) do write_record(record) end
     end
 
     if options.sql_footer then
-      sql_fd:write(options.sql_footer .. '\n')
+      sql_fd:write(options.sql_footer, '\n')
     end
   end, std.debug.traceback)
 
+  local has_raw_file = chunk_fd ~= nil
+
   if sql_fd then sql_fd:close() end
   if chunk_fd then chunk_fd:close() end
 
   std.assert(ok, err)
 
-  std.assert(options.remove(raw_path))
+  if has_raw_file then std.assert(options.remove(raw_path)) end
+end
+
+function export.pack_sort_job(raw_path, ready_path, options, chunk_buckets)
+  -- everything sort_chunk() needs, for a worker thread's lua state. the
+  -- records kept in memory are taken from the buckets
+
+  local records
+  local run_ends
+
+  if chunk_buckets then records, run_ends = chunk_buckets:take(raw_path) end
+
+  local bufs = {}
+
+  for i, record in std.ipairs(records or {}) do
+    std.table.insert(bufs, export.pack_chunk_record(record))
+  end
+
+  run_ends = run_ends or {}
+
+  return ('ssBsjBBBBsj' .. ('j'):rep(#run_ends)):pack(raw_path, ready_path,
+      options.relaxed_order and 1 or 0, options.sql_footer or '',
+      options.io_size, options.sql_footer and 1 or 0,
+      options.open_writer and 1 or 0, options.io_uring and 1 or 0,
+      records and 1 or 0, std.table.concat(bufs), #run_ends,
+      std.table.unpack(run_ends))
+end
+
+function export.sort_chunk_job(job)
+  -- sorts a chunk packed by pack_sort_job(), the files are opened and
+  -- removed by the standard library and written by os_ext's writer.
+  -- the writes are waited for here, the caller's hooks get a complete file
+
+  local raw_path, ready_path, relaxed_order, sql_footer, io_size, has_footer,
+      has_writer, io_uring, has_records, records_buf, run_count, n =
+      ('ssBsjBBBBsj'):unpack(job)
+  local run_ends = std.table.move(
+      std.table.pack(('j'):rep(run_count):unpack(job, n)),
+      1, run_count, 1, {})
+  local records
+  local record_n = 1
+
+  if has_records == 1 then
+    records = {}
+
+    while record_n <= #records_buf do
+      local size
+
+      size, record_n = ('j'):unpack(records_buf, record_n)
+      std.table.insert(records,
+          export.unpack_chunk_record(records_buf, record_n))
+      record_n = record_n + size
+    end
+  end
+
+  local chunk_buckets = {
+    take = function()
+      return records, run_count > 0 and run_ends or nil
+    end,
+  }
+
+  local options = {
+    io_size = io_size,
+    relaxed_order = relaxed_order == 1,
+    sql_footer = has_footer == 1 and sql_footer,
+    open = std.io.open,
+    remove = std.os.remove,
+    open_writer = has_writer == 1 and os_ext.open_writer,
+    io_uring = io_uring == 1,
+    wait_writers = os_ext.wait_writers,
+  }
+
+  export.sort_chunk(raw_path, ready_path, options, chunk_buckets)
+
+  if options.open_writer and options.wait_writers then
+    std.assert(options.wait_writers())
+  end
 end
 
 return export
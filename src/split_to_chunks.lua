@@ -9,37 +9,107 @@ function export.make_options_from_pg_dump_splitter(options)
     io_size = options.io_size,
     lex_consts = options.lex_consts,
     lex_trans_more = options.lex_trans_more,
+    lex_translate = options.lex_translate,
     make_pattern_rules = options.make_pattern_rules,
     lexemes_in_pt_ctx = options.lexemes_in_pt_ctx,
+    native_matcher = options.native_matcher,
+    max_pt_states = options.max_pt_states,
+    profile_path = options.profile_path,
+    profile_top = options.profile_top,
+    shape_cache_size = options.shape_cache_size,
+    open = options.open,
     save_unprocessed = options.save_unprocessed,
   }
 end
 
+function export.is_mapped(dump_fd)
+  -- dump_fd is either a file or a map made by os_ext.map_file()
+
+  return dump_fd.slice ~= nil
+end
+
+function export.lex_ctx_iter_feed(iter_ctx)
+  -- lexes the next block, returns false when there are no more blocks
+
+  if iter_ctx.final then return false end
+
+  local buf
+
+  if iter_ctx.mapped then
+    -- the lexer takes the next block right from the map
+
+    if iter_ctx.dump_fd:seek() < iter_ctx.dump_fd:size() then
+      buf = iter_ctx.dump_fd
+    end
+  else
+    buf = iter_ctx.dump_fd:read(iter_ctx.options.io_size)
+  end
+
+  if iter_ctx.batch then
+    iter_ctx.batch:free()
+  end
+
+  -- without a callback the lexer returns all lexemes of the block at once.
+  -- strings and comments are translated later, only the ones rules look at,
+  -- unless the lexemes are kept for hooks
+
+  local options = iter_ctx.options
+
+  iter_ctx.batch = iter_ctx.lex_ctx:feed(buf, nil,
+      options.lex_trans_more or options.lexemes_in_pt_ctx, options.io_size)
+  iter_ctx.batch_i = 0
+  iter_ctx.batch_count = iter_ctx.batch:count()
+
+  if not buf then
+    iter_ctx.final = true
+  end
+
+  return true
+end
+
 function export.lex_ctx_iter_item(iter_ctx)
   while true do
-    if #iter_ctx.items > 0 then
-      return std.table.unpack(std.table.remove(iter_ctx.items))
+    if iter_ctx.batch_i < iter_ctx.batch_count then
+      iter_ctx.batch_i = iter_ctx.batch_i + 1
+
+      return iter_ctx.batch:get(iter_ctx.batch_i)
     end
 
-    if iter_ctx.final then return end
+    if not export.lex_ctx_iter_feed(iter_ctx) then return end
+  end
+end
 
-    local buf = iter_ctx.dump_fd:read(iter_ctx.options.io_size)
-    local items = {}
-    local function yield(...)
-      std.table.insert(items, std.table.pack(...))
-    end
+function export.lex_ctx_iter_skip_stmt(iter_ctx, is_counted)
+  -- skips lexemes up to the final ``;`` of the current statement, so that
+  -- the ``;`` is the next item. the lexer has found statement boundaries
+  -- already. if is_counted, returns the number of skipped lexemes which
+  -- aren't comments, for the profiler
 
-    iter_ctx.lex_ctx:feed(buf, yield, iter_ctx.options.lex_trans_more)
+  local count = 0
 
-    while true do
-      local item = std.table.remove(items)
-      if not item then break end
-      std.table.insert(iter_ctx.items, item)
-    end
+  local function count_to(end_i)
+    if not is_counted then return end
 
-    if not buf then
-      iter_ctx.final = true
+    count = count + iter_ctx.batch:count_significant(iter_ctx.batch_i + 1,
+        end_i)
+  end
+
+  while true do
+    local end_i = iter_ctx.batch and
+        iter_ctx.batch:next_stmt_end(iter_ctx.batch_i + 1)
+
+    if end_i then
+      count_to(end_i - 1)
+      iter_ctx.batch_i = end_i - 1
+
+      return count
     end
+
+    if iter_ctx.batch then count_to(iter_ctx.batch_count) end
+
+    iter_ctx.batch_i = iter_ctx.batch_count
+
+    if not export.lex_ctx_iter_feed(iter_ctx) then return count end
   end
 end
 
@@ -48,8 +118,10 @@ function export.lex_ctx_iter(lex_ctx, dump_fd, options)
     lex_ctx = lex_ctx,
     dump_fd = dump_fd,
     options = options,
+    mapped = export.is_mapped(dump_fd),
     final = false,
-    items = {}
+    batch_i = 0,
+    batch_count = 0,
   }
 
   return export.lex_ctx_iter_item, iter_ctx
@@ -57,29 +129,109 @@ end
 
 export.rule_ctx_proto = {}
 
+-- a value version is a list of captured values, the last one first. it's
+-- never changed, so states share it and a new value is put in front of it
+
 function export.rule_ctx_proto:put_value(key, value)
-  if not self.value_version then self.value_version = {} end
+  local prev = self.value_version
+  local k = std.tostring(key)
+  local v = std.tostring(value)
 
-  self.value_version[key] = value
+  self.value_version = {
+    key = key,
+    value = value,
+    prev = prev,
+    -- for keys of states
+    text = (prev and prev.text or '') .. #k .. ':' .. k ..
+        std.type(value):sub(1, 1) .. #v .. ':' .. v,
+  }
 end
 
 function export.rule_ctx_proto:dup_value_version(to_pt)
-  if not self.value_version then return end
+  self.pt_ctx.value_versions[to_pt] = self.value_version
+end
+
+function export.make_obj_values(value_version)
+  local obj_values = {}
+  local is_put = {}
+
+  while value_version do
+    local key = value_version.key
+
+    if not is_put[key] then
+      is_put[key] = true
+      obj_values[key] = value_version.value
+    end
+
+    value_version = value_version.prev
+  end
+
+  return obj_values
+end
+
+-- ids of rule tables for keys of states
+export.rule_ids = std.setmetatable({}, {__mode = 'k'})
+export.rule_id_count = 0
+
+function export.make_pt_key(pt, value_version)
+  -- equal states get equal keys: the same object type, the same rule
+  -- tables left and the same values captured in the same order
+
+  local parts = {pt[1]}
+
+  for i = 2, #pt do
+    local rule = pt[i]
+    local rule_id = export.rule_ids[rule]
 
-  local next_val_ver = {}
-  self.pt_ctx.value_versions[to_pt] = next_val_ver
+    if not rule_id then
+      export.rule_id_count = export.rule_id_count + 1
+      rule_id = export.rule_id_count
+      export.rule_ids[rule] = rule_id
+    end
+
+    parts[i] = rule_id
+  end
+
+  if value_version then
+    std.table.insert(parts, value_version.text)
+  end
+
+  return std.table.concat(parts, ' ')
+end
+
+function export.rule_ctx_proto:is_new_pt(seen, next_pt)
+  -- a state equal to a pushed one would do nothing new
+
+  local key = export.make_pt_key(next_pt, self.value_version)
+
+  if seen[key] then return false end
+
+  local step = self.step
+
+  seen[key] = true
+  step.count = step.count + 1
 
-  for k, v in std.pairs(self.value_version) do
-    next_val_ver[k] = v
+  if step.max_count and step.count > step.max_count then
+    std.error('pos(' .. self.pt_ctx.location.lpos ..
+        ') line(' .. self.pt_ctx.location.lline ..
+        ') col(' .. self.pt_ctx.location.lcol ..
+        '): too many pattern states (more than ' .. step.max_count ..
+        '), obj_type: ' .. self.obj_type)
   end
+
+  return true
 end
 
 function export.rule_ctx_proto:push_pt(next_pt)
+  if not self:is_new_pt(self.step.next_seen, next_pt) then return end
+
   std.table.insert(self.next_pts, next_pt)
   self:dup_value_version(next_pt)
 end
 
 function export.rule_ctx_proto:push_pt_soon(next_pt)
+  if not self:is_new_pt(self.step.soon_seen, next_pt) then return end
+
   std.table.insert(self.next_pts_soon, next_pt)
   self:dup_value_version(next_pt)
 end
@@ -93,10 +245,73 @@ function export.rule_ctx_proto:push_shifted_pt()
   self:push_pt(next_pt)
 end
 
+-- reserved key words got from
+-- https://www.postgresql.org/docs/11/static/sql-keywords-appendix.html
+export.reserved_kw = {'all', 'analyse', 'analyze', 'and', 'any', 'array', 'as',
+    'asc', 'asymmetric', 'both', 'case', 'cast', 'check', 'collate',
+    'column', 'constraint', 'create', 'current_catalog', 'current_date',
+    'current_role', 'current_time', 'current_timestamp', 'current_user',
+    'default', 'deferrable', 'desc', 'distinct', 'do', 'else', 'end',
+    'except', 'false', 'fetch', 'for', 'foreign', 'from', 'grant', 'group',
+    'having', 'in', 'initially', 'intersect', 'into', 'lateral', 'leading',
+    'limit', 'localtime', 'localtimestamp', 'not', 'null', 'offset', 'on',
+    'only', 'or', 'order', 'placing', 'primary', 'references', 'returning',
+    'select', 'session_user', 'some', 'symmetric', 'table', 'then', 'to',
+    'trailing', 'true', 'union', 'unique', 'user', 'using', 'variadic',
+    'when', 'where', 'window', 'with'}
+
+function export.make_keywords(pattern_rules)
+  -- interns the reserved key words and the key words of kw rules.
+  -- the reserved key words go first, so their ids are 1..#reserved_kw.
+  -- each kw rule gets its key word id as rule.kw_id
+
+  local keywords = {}
+  local keyword_ids = {}
+  local visited = {}
+
+  local function intern(word)
+    local kw_id = keyword_ids[word]
+
+    if not kw_id then
+      std.table.insert(keywords, word)
+      kw_id = #keywords
+      keyword_ids[word] = kw_id
+    end
+
+    return kw_id
+  end
+
+  local function walk(node)
+    if visited[node] then return end
+    visited[node] = true
+
+    if node[1] == export.kw_rule_handler and
+        std.type(node[2]) == 'string' then
+      node.kw_id = intern(node[2])
+    end
+
+    for i, v in std.ipairs(node) do
+      if std.type(v) == 'table' then walk(v) end
+    end
+  end
+
+  for i, v in std.ipairs(export.reserved_kw) do intern(v) end
+
+  walk(pattern_rules)
+
+  return keywords, keyword_ids
+end
+
 function export.kw_rule_handler(rule_ctx, lexeme, options)
+  -- kw_id is set by make_keywords(), a rule added after it is matched
+  -- by its word
+
+  local rule = rule_ctx.rule
+
   if lexeme.level == 1 and
       lexeme.lex_subtype == options.lex_consts.subtype_simple_ident and
-      lexeme.translated_value == rule_ctx.rule[2] then
+      (rule.kw_id and lexeme.kw_id == rule.kw_id or
+        not rule.kw_id and lexeme.translated_value == rule[2]) then
     rule_ctx:push_shifted_pt()
   end
 end
@@ -118,39 +333,36 @@ function export.rs_rule_handler(rule_ctx, lexeme, options)
 end
 
 function export.make_ident_rule_handler()
-  -- reserved key words got from
-  -- https://www.postgresql.org/docs/11/static/sql-keywords-appendix.html
-  local reserved_kw = {'all', 'analyse', 'analyze', 'and', 'any', 'array', 'as',
-      'asc', 'asymmetric', 'both', 'case', 'cast', 'check', 'collate',
-      'column', 'constraint', 'create', 'current_catalog', 'current_date',
-      'current_role', 'current_time', 'current_timestamp', 'current_user',
-      'default', 'deferrable', 'desc', 'distinct', 'do', 'else', 'end',
-      'except', 'false', 'fetch', 'for', 'foreign', 'from', 'grant', 'group',
-      'having', 'in', 'initially', 'intersect', 'into', 'lateral', 'leading',
-      'limit', 'localtime', 'localtimestamp', 'not', 'null', 'offset', 'on',
-      'only', 'or', 'order', 'placing', 'primary', 'references', 'returning',
-      'select', 'session_user', 'some', 'symmetric', 'table', 'then', 'to',
-      'trailing', 'true', 'union', 'unique', 'user', 'using', 'variadic',
-      'when', 'where', 'window', 'with'}
-
-  local reserved_kw_set = {}
-  for i, v in std.ipairs(reserved_kw) do reserved_kw_set[v] = true end
-
   return function(rule_ctx, lexeme, options)
     if lexeme.level == 1 and
         lexeme.lex_type == options.lex_consts.type_ident and
         not (lexeme.lex_subtype == options.lex_consts.subtype_simple_ident and
-            reserved_kw_set[lexeme.translated_value]) then
+            lexeme.kw_id ~= 0 and lexeme.kw_id <= #export.reserved_kw) then
       rule_ctx:put_value(rule_ctx.rule[2], lexeme.translated_value)
       rule_ctx:push_shifted_pt()
     end
   end
 end
 
+function export.translated_value(lexeme, options)
+  -- strings and comments come untranslated from the lexer, the translation
+  -- is made once for all patterns which read it
+
+  local translated_value = lexeme.translated_value
+
+  if translated_value == nil then
+    translated_value = options.lex_translate(lexeme.lex_subtype, lexeme.value)
+    lexeme.translated_value = translated_value
+  end
+
+  return translated_value
+end
+
 function export.str_rule_handler(rule_ctx, lexeme, options)
   if lexeme.level == 1 and
       lexeme.lex_type == options.lex_consts.type_string then
-    rule_ctx:put_value(rule_ctx.rule[2], lexeme.translated_value)
+    rule_ctx:put_value(rule_ctx.rule[2],
+        export.translated_value(lexeme, options))
     rule_ctx:push_shifted_pt()
   end
 end
@@ -182,7 +394,8 @@ function export.en_rule_handler(rule_ctx, lexeme, options)
         rule_ctx.pt_ctx.obj_priority < obj_priority then
       rule_ctx.pt_ctx.obj_type = rule_ctx.obj_type
       rule_ctx.pt_ctx.obj_priority = obj_priority
-      rule_ctx.pt_ctx.obj_values = rule_ctx.value_version or {}
+      rule_ctx.pt_ctx.obj_values =
+          export.make_obj_values(rule_ctx.value_version)
     end
   end
 end
@@ -220,7 +433,10 @@ function export.rep_rule_handler(rule_ctx, lexeme, options)
   rule_ctx:push_pt_soon(next_pt_wo_seq)
 end
 
-function export.make_pattern_rules(options)
+-- rule handlers which the lexer's native matcher knows, by their op names
+export.native_rule_ops = std.setmetatable({}, {__mode = 'k'})
+
+function export.make_rule_handlers()
   local handlers = {
     kw_rule_handler = export.kw_rule_handler,
     ss_rule_handler = export.ss_rule_handler,
@@ -234,20 +450,162 @@ function export.make_pattern_rules(options)
     rep_rule_handler = export.rep_rule_handler,
   }
 
-  return pattern_rules_lib.make_pattern_rules(handlers)
+  for name, handler in std.pairs(handlers) do
+    export.native_rule_ops[handler] = name:match('^(.*)_rule_handler$')
+  end
+
+  return handlers
 end
 
-function export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
-    value, translated_value, level, options)
-  local next_pts = {}
-  local next_pts_soon = pt_ctx.pts
+function export.make_pattern_rules(options)
+  return pattern_rules_lib.make_pattern_rules(export.make_rule_handlers())
+end
 
+function export.compile_pattern_rules(pattern_rules)
+  -- compiles the rules for the lexer's native matcher (see pt-match.h).
+  -- a fork or rep is laid out with jumps, so that a state is just
+  -- an instruction index. returns nil and the reason if a rule can't be
+  -- compiled, then split_to_chunks runs the rules by itself
+
+  local compiled = {
+    code = {},
+    symbols = {},
+    obj_types = {},
+    starts = {},
+    keys = {},
+  }
+  local code = compiled.code
+  local symbol_ids = {}
+  local key_ids = {}
+
+  local function emit(op, arg, arg2)
+    std.table.move({op, arg or 0, arg2 or 0}, 1, 3, #code + 1, code)
+
+    return #code // 3
+  end
+
+  local function patch(pc, arg)
+    code[pc * 3 - 1] = arg
+  end
+
+  local function intern(list, ids, value)
+    if not ids[value] then
+      std.table.insert(list, value)
+      ids[value] = #list
+    end
+
+    return ids[value]
+  end
+
+  local compile_seq
+
+  local function compile_rule(rule, obj_i)
+    local op = export.native_rule_ops[rule[1]]
+
+    if op == 'kw' then
+      if not rule.kw_id then return nil, 'kw rule without kw_id' end
+
+      emit(op, rule.kw_id)
+    elseif op == 'ss' or op == 'rs' then
+      if std.type(rule[2]) ~= 'string' then
+        return nil, op .. ' rule without string'
+      end
+
+      emit(op, intern(compiled.symbols, symbol_ids, rule[2]))
+    elseif op == 'ident' or op == 'str' or op == 'op_ident' then
+      if std.type(rule[2]) ~= 'string' then
+        return nil, op .. ' rule without key'
+      end
+
+      emit(op, intern(compiled.keys, key_ids, rule[2]))
+    elseif op == 'en' then
+      local obj_priority = rule[2] or 0
+
+      if std.math.type(obj_priority) ~= 'integer' then
+        return nil, 'en rule with non-integer priority'
+      end
+
+      emit(op, obj_i, obj_priority)
+    elseif op == 'any' then
+      emit(op)
+    elseif op == 'fork' then
+      local alt_pc = emit(op, #rule - 1)
+      local jmp_pcs = {}
+
+      for i = 2, #rule do emit('alt') end
+
+      for i = 2, #rule do
+        patch(alt_pc + i - 1, #code // 3 + 1)
+
+        local ok, err = compile_seq(rule[i], 1, obj_i)
+
+        if not ok then return nil, err end
+
+        std.table.insert(jmp_pcs, emit('jmp'))
+      end
+
+      for i, jmp_pc in std.ipairs(jmp_pcs) do patch(jmp_pc, #code // 3 + 1) end
+    elseif op == 'rep' then
+      local rep_pc = emit(op)
+      local ok, err = compile_seq(rule, 2, obj_i)
+
+      if not ok then return nil, err end
+
+      emit('jmp', rep_pc)
+      patch(rep_pc, #code // 3 + 1)
+    else
+      return nil, 'unknown rule handler'
+    end
+
+    return true
+  end
+
+  function compile_seq(rules, first, obj_i)
+    for i = first, #rules do
+      local ok, err = compile_rule(rules[i], obj_i)
+
+      if not ok then return nil, err end
+    end
+
+    return true
+  end
+
+  for obj_i, pattern in std.ipairs(pattern_rules) do
+    if std.type(pattern[1]) ~= 'string' then
+      return nil, 'pattern without obj_type'
+    end
+
+    compiled.obj_types[obj_i] = pattern[1]
+    compiled.starts[obj_i] = #code // 3 + 1
+
+    local ok, err = compile_seq(pattern, 2, obj_i)
+
+    if not ok then return nil, err end
+
+    emit('end')
+  end
+
+  if #compiled.keys > export.native_max_keys then
+    return nil, 'too many keys'
+  end
+
+  if #code == 0 then emit('end') end
+
+  return compiled
+end
+
+-- pt_match_max_keys in pt-match.h
+export.native_max_keys = 16
+
+function export.make_lexeme(pt_ctx, lex_type, lex_subtype, location,
+    value, translated_value, kw_id, level, options)
   local lexeme = {
     lex_type = lex_type,
     lex_subtype = lex_subtype,
     location = location,
     value = value,
     translated_value = translated_value,
+    kw_id = kw_id,
     level = level,
   }
 
@@ -256,6 +614,24 @@ function export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
     std.table.insert(pt_ctx.lexemes, lexeme)
   end
 
+  return lexeme
+end
+
+function export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
+    value, translated_value, kw_id, level, options)
+  local next_pts = {}
+  local next_pts_soon = pt_ctx.pts
+
+  local lexeme = export.make_lexeme(pt_ctx, lex_type, lex_subtype, location,
+      value, translated_value, kw_id, level, options)
+
+  local step = {
+    count = 0,
+    max_count = options.max_pt_states,
+    next_seen = {},
+    soon_seen = {},
+  }
+
   repeat
     local pts = next_pts_soon
     next_pts_soon = {}
@@ -278,6 +654,7 @@ function export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
           obj_type = obj_type,
           rule = rule,
           value_version = pt_ctx.value_versions[pt],
+          step = step,
         },
         {__index = export.rule_ctx_proto}
       )
@@ -291,7 +668,259 @@ function export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
   pt_ctx.pts = next_pts
 end
 
+function export.make_shape_cache(pattern_rules, options)
+  -- caches the states by shapes of statements. a shape is the lexemes of
+  -- a statement with identifiers and strings abstracted, see
+  -- make_shape_token(). dumps repeat a few shapes over and over, so
+  -- the patterns are processed once per shape prefix: a node of the cache
+  -- keeps the states which process_pt_ctx() leaves after the prefix.
+  -- when it has more than options.shape_cache_size nodes, it's pruned to
+  -- its first levels, see prune_shape_cache()
+
+  -- the states are made by a shape alone, that's true only for
+  -- the rule handlers of this module
+
+  local function is_known(rules, first)
+    for i = first, #rules do
+      local rule = rules[i]
+      local op = export.native_rule_ops[rule[1]]
+
+      if not op then return false end
+
+      if op == 'fork' then
+        for j = 2, #rule do
+          if not is_known(rule[j], 1) then return false end
+        end
+      elseif op == 'rep' and not is_known(rule, 2) then
+        return false
+      end
+    end
+
+    return true
+  end
+
+  if not options.shape_cache_size or options.shape_cache_size <= 0 then
+    return nil
+  end
+
+  for pattern_i, pattern in std.ipairs(pattern_rules) do
+    if not is_known(pattern, 2) then return nil end
+  end
+
+  return {
+    root = {
+      children = {},
+      pts = pattern_rules,
+      value_versions = {},
+    },
+    node_count = 0,
+    max_node_count = options.shape_cache_size,
+    -- captured instead of identifiers and strings, by their positions
+    markers = {},
+  }
+end
+
+-- levels of the shape cache kept by pruning, they are shared by most shapes
+export.shape_cache_kept_depth = 2
+
+function export.prune_shape_cache(shape_cache)
+  -- drops the nodes below the kept depth. the cache is dropped as a whole
+  -- if the kept nodes are still more than a half of the limit
+
+  local node_count = 0
+
+  local function prune(node, depth)
+    for token, child in std.pairs(node.children) do
+      node_count = node_count + 1
+
+      if depth < export.shape_cache_kept_depth then
+        prune(child, depth + 1)
+      else
+        child.children = {}
+      end
+    end
+  end
+
+  prune(shape_cache.root, 1)
+
+  if node_count > shape_cache.max_node_count // 2 then
+    shape_cache.root.children = {}
+    node_count = 0
+  end
+
+  shape_cache.node_count = node_count
+end
+
+function export.make_shape_token(lex_type, lex_subtype, value, kw_id, level,
+    options)
+  -- what the rule handlers look at in a lexeme
+
+  if level ~= 1 then
+    return ''
+  elseif lex_subtype == options.lex_consts.subtype_simple_ident then
+    return 'k' .. kw_id
+  elseif lex_subtype == options.lex_consts.subtype_special_symbols or
+      lex_subtype == options.lex_consts.subtype_random_symbols then
+    return lex_subtype .. ':' .. value
+  end
+
+  return lex_type .. '.' .. lex_subtype
+end
+
+function export.copy_value_versions(pts, value_versions)
+  -- value versions are shared, only the map is copied
+
+  local copy = std.setmetatable({}, {__mode = 'k'})
+
+  for pt_i, pt in std.ipairs(pts) do
+    copy[pt] = value_versions[pt]
+  end
+
+  return copy
+end
+
+function export.is_shape_captured(lex_type, level, options)
+  return level == 1 and (lex_type == options.lex_consts.type_ident or
+      lex_type == options.lex_consts.type_string)
+end
+
+function export.process_pt_ctx_by_shape(pt_ctx, shape_cache, lex_type,
+    lex_subtype, location, value, translated_value, kw_id, level, options)
+  -- the states are taken from the shape cache, a missing node is made by
+  -- processing the patterns with the states of its parent
+
+  if not shape_cache then
+    export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
+        value, translated_value, kw_id, level, options)
+
+    return
+  end
+
+  if not pt_ctx.shape_node then
+    if shape_cache.node_count > shape_cache.max_node_count then
+      export.prune_shape_cache(shape_cache)
+    end
+
+    pt_ctx.shape_node = shape_cache.root
+    pt_ctx.shape_position = 0
+    pt_ctx.shape_values = {}
+  end
+
+  local node = pt_ctx.shape_node
+  local position = pt_ctx.shape_position + 1
+  local token = export.make_shape_token(lex_type, lex_subtype, value, kw_id,
+      level, options)
+  local is_end = level == 1 and
+      lex_subtype == options.lex_consts.subtype_special_symbols and
+      value == ';'
+  local is_captured = export.is_shape_captured(lex_type, level, options)
+  local child = node.children[token]
+
+  if not child and not is_end and
+      (#node.pts == 0 or export.is_pt_ctx_decided(node)) then
+    -- the states stay the same till the statement's end
+
+    child = node
+  end
+
+  if not child then
+    local marker = translated_value
+
+    if is_captured then
+      marker = shape_cache.markers[position]
+
+      if not marker then
+        marker = {position = position}
+        shape_cache.markers[position] = marker
+      end
+    end
+
+    -- errors of processing refer to the statement's beginning
+
+    local node_pt_ctx = {
+      pts = node.pts,
+      location = pt_ctx.location,
+      value_versions = export.copy_value_versions(node.pts,
+          node.value_versions),
+    }
+
+    export.process_pt_ctx(node_pt_ctx, lex_type, lex_subtype, location,
+        value, marker, kw_id, level, options)
+
+    child = {
+      children = {},
+      pts = node_pt_ctx.pts,
+      value_versions = node_pt_ctx.value_versions,
+      obj_type = node_pt_ctx.obj_type,
+      obj_priority = node_pt_ctx.obj_priority,
+      obj_values = node_pt_ctx.obj_values,
+    }
+
+    node.children[token] = child
+    shape_cache.node_count = shape_cache.node_count + 1
+  end
+
+  export.make_lexeme(pt_ctx, lex_type, lex_subtype, location,
+      value, translated_value, kw_id, level, options)
+
+  if is_captured then
+    pt_ctx.shape_values[position] = {
+      lex_type = lex_type,
+      lex_subtype = lex_subtype,
+      value = value,
+      translated_value = translated_value,
+    }
+  end
+
+  pt_ctx.shape_node = child
+  pt_ctx.shape_position = position
+  pt_ctx.pts = child.pts
+
+  if child.obj_type then
+    -- the markers are replaced by the values of the statement
+
+    local obj_values = {}
+
+    for key, obj_value in std.pairs(child.obj_values) do
+      if std.type(obj_value) == 'table' and
+          shape_cache.markers[obj_value.position] == obj_value then
+        local lexeme = pt_ctx.shape_values[obj_value.position]
+
+        if lexeme.lex_type == options.lex_consts.type_string then
+          obj_value = export.translated_value(lexeme, options)
+        else
+          obj_value = lexeme.translated_value
+        end
+      end
+
+      obj_values[key] = obj_value
+    end
+
+    pt_ctx.obj_type = child.obj_type
+    pt_ctx.obj_priority = child.obj_priority
+    pt_ctx.obj_values = obj_values
+  end
+end
+
+function export.is_pt_ctx_decided(pt_ctx)
+  -- every state is at ``{any}, {en}``, so the states stay the same till
+  -- the statement's final ``;``
+
+  for pt_i, pt in std.ipairs(pt_ctx.pts) do
+    if #pt ~= 3 or pt[2][1] ~= export.any_rule_handler or
+        pt[3][1] ~= export.en_rule_handler then
+      return false
+    end
+  end
+
+  return true
+end
+
 function export.extract_dump_data(dump_fd, begin_pos, end_pos)
+  if export.is_mapped(dump_fd) then
+    return dump_fd:slice(begin_pos, end_pos - 1)
+  end
+
   local saved_pos = dump_fd:seek()
   dump_fd:seek('set', begin_pos - 1) -- begin_pos is 1 based
   local data = dump_fd:read(end_pos - begin_pos)
@@ -300,17 +929,319 @@ function export.extract_dump_data(dump_fd, begin_pos, end_pos)
   return data
 end
 
+function export.finish_pt_ctx(pt_ctx, dump_fd, end_pos, chunks_ctx,
+    hooks_ctx, options)
+  -- the statement is finished by ``;``
+
+  local dump_data = export.extract_dump_data(dump_fd,
+      pt_ctx.location.lpos, end_pos)
+  local skip
+
+  if pt_ctx.obj_type then
+
+    if hooks_ctx.processed_pt_handler then
+      skip = hooks_ctx:processed_pt_handler(pt_ctx, dump_data)
+    else
+      skip = false
+    end
+
+    if not skip then
+      chunks_ctx:add(pt_ctx.obj_type, pt_ctx.obj_values, dump_data)
+    end
+  else
+    if hooks_ctx.unprocessed_pt_handler then
+      skip = hooks_ctx:unprocessed_pt_handler(pt_ctx, dump_data,
+          pt_ctx.error_dump_data)
+    else
+      skip = options.save_unprocessed
+    end
+
+    if not skip then
+      local error_dump_data = pt_ctx.error_dump_data or '(no error_dump_data)'
+
+      std.error('pos(' .. pt_ctx.location.lpos .. ') line(' ..
+          pt_ctx.location.lline ..
+          ') col(' .. pt_ctx.location.lcol ..
+          '): unprocessed pattern:\n' .. dump_data ..
+          '\n' .. ('-'):rep(60) .. '\n' ..
+          error_dump_data)
+    end
+
+    chunks_ctx:add(pt_ctx.obj_type or 'unprocessed',
+        pt_ctx.obj_values or {}, dump_data)
+  end
+
+  if export.is_mapped(dump_fd) then
+    -- the statements before are never extracted again
+
+    dump_fd:drop_behind(end_pos - 1)
+  end
+end
+
+function export.finish_eof_pt_ctx(pt_ctx, dump_fd, hooks_ctx, options)
+  -- the statement is not finished till EOF
+
+  local dump_data = export.extract_dump_data(dump_fd,
+      pt_ctx.location.lpos, dump_fd:seek() + 1)
+  local skip
+
+  if hooks_ctx.unprocessed_eof_pt_handler then
+    skip = hooks_ctx:unprocessed_eof_pt_handler(pt_ctx, dump_data)
+  else
+    skip = false
+  end
+
+  if not skip then
+      std.error('pos(' .. pt_ctx.location.lpos .. ') line(' ..
+          pt_ctx.location.lline .. ') col(' .. pt_ctx.location.lcol ..
+          '): unprocessed pattern at EOF: ' .. dump_data)
+  end
+end
+
+function export.make_profiler(options)
+  -- the profiler is on when there's a path for its report
+
+  if not options.profile_path then return nil end
+
+  return {
+    path = options.profile_path,
+    top = options.profile_top,
+    open = options.open,
+    stmt_count = 0,
+    lexemes = 0,
+    elapsed = 0,
+    top_stmts = {},
+    obj_types = {},
+  }
+end
+
+function export.profile_stmt(profiler, pt_ctx, lexemes, peak_states, elapsed)
+  local obj_type = pt_ctx.obj_type or 'unprocessed'
+  local by_obj_type = profiler.obj_types[obj_type]
+
+  if not by_obj_type then
+    by_obj_type = {
+      obj_type = obj_type,
+      stmt_count = 0,
+      lexemes = 0,
+      peak_states = 0,
+      elapsed = 0,
+    }
+    profiler.obj_types[obj_type] = by_obj_type
+  end
+
+  profiler.stmt_count = profiler.stmt_count + 1
+  profiler.lexemes = profiler.lexemes + lexemes
+  profiler.elapsed = profiler.elapsed + elapsed
+  by_obj_type.stmt_count = by_obj_type.stmt_count + 1
+  by_obj_type.lexemes = by_obj_type.lexemes + lexemes
+  by_obj_type.peak_states = std.math.max(by_obj_type.peak_states,
+      peak_states)
+  by_obj_type.elapsed = by_obj_type.elapsed + elapsed
+
+  -- the most expensive statements, sorted by time
+
+  local top_stmts = profiler.top_stmts
+  local i = #top_stmts
+
+  if i >= profiler.top and (i == 0 or top_stmts[i].elapsed >= elapsed) then
+    return
+  end
+
+  while i > 0 and top_stmts[i].elapsed < elapsed do i = i - 1 end
+
+  std.table.insert(top_stmts, i + 1, {
+    location = pt_ctx.location,
+    obj_type = obj_type,
+    lexemes = lexemes,
+    peak_states = peak_states,
+    elapsed = elapsed,
+  })
+
+  if #top_stmts > profiler.top then std.table.remove(top_stmts) end
+end
+
+function export.write_profile(profiler)
+  local obj_types = {}
+
+  for obj_type, by_obj_type in std.pairs(profiler.obj_types) do
+    std.table.insert(obj_types, by_obj_type)
+  end
+
+  std.table.sort(obj_types, function(a, b)
+    if a.elapsed ~= b.elapsed then return a.elapsed > b.elapsed end
+
+    return a.obj_type < b.obj_type
+  end)
+
+  local fd = std.assert(profiler.open(profiler.path, 'wb'))
+
+  fd:write(('statements: %d, lexemes: %d, time: %.3f s\n'):format(
+      profiler.stmt_count, profiler.lexemes, profiler.elapsed))
+  fd:write('\nby obj_type:\n')
+  fd:write(('%-40s %10s %12s %11s %10s\n'):format(
+      'obj_type', 'statements', 'lexemes', 'peak_states', 'time'))
+
+  for i, by_obj_type in std.ipairs(obj_types) do
+    fd:write(('%-40s %10d %12d %11d %10.3f\n'):format(by_obj_type.obj_type,
+        by_obj_type.stmt_count, by_obj_type.lexemes, by_obj_type.peak_states,
+        by_obj_type.elapsed))
+  end
+
+  fd:write(('\ntop %d statements:\n'):format(#profiler.top_stmts))
+  fd:write(('%-36s %-40s %10s %11s %10s\n'):format(
+      'location', 'obj_type', 'lexemes', 'peak_states', 'time'))
+
+  for i, stmt in std.ipairs(profiler.top_stmts) do
+    local location = 'pos(' .. stmt.location.lpos ..
+        ') line(' .. stmt.location.lline ..
+        ') col(' .. stmt.location.lcol .. ')'
+
+    fd:write(('%-36s %-40s %10d %11d %10.6f\n'):format(location,
+        stmt.obj_type, stmt.lexemes, stmt.peak_states, stmt.elapsed))
+  end
+
+  fd:close()
+end
+
+function export.make_matched_pt_ctx(compiled, dump_fd, location,
+    obj_i, obj_priority, dead_end_pos, ...)
+  -- pt_ctx of a statement matched by the lexer, the same as
+  -- process_pt_ctx() would leave
+
+  local pt_ctx = {
+    pts = {},
+    location = location,
+  }
+
+  if obj_i then
+    local obj_values = {}
+
+    for i = 1, std.select('#', ...), 2 do
+      local key_i, value = std.select(i, ...)
+
+      obj_values[compiled.keys[key_i]] = value
+    end
+
+    pt_ctx.obj_type = compiled.obj_types[obj_i]
+    pt_ctx.obj_priority = obj_priority
+    pt_ctx.obj_values = obj_values
+  end
+
+  if dead_end_pos then
+    pt_ctx.error_dump_data = export.extract_dump_data(dump_fd,
+        location.lpos, dead_end_pos)
+  end
+
+  return pt_ctx
+end
+
+function export.split_to_chunks_natively(lex_ctx, dump_fd, compiled,
+    chunks_ctx, hooks_ctx, profiler, options)
+  -- the lexer matches statements by itself, only finished statements come
+  -- here
+
+  local iter, iter_ctx = export.lex_ctx_iter(lex_ctx, dump_fd, options)
+
+  local lpos, lline, lcol, dead_end_pos
+
+  while export.lex_ctx_iter_feed(iter_ctx) do
+    local batch = iter_ctx.batch
+
+    for j = 1, batch:stmt_count() do
+      local begin_pos, end_pos = batch:stmt(j)
+      local lline, lcol = batch:stmt_location(j)
+      local location = {lpos = begin_pos, lline = lline, lcol = lcol}
+      local pt_ctx = export.make_matched_pt_ctx(compiled, dump_fd, location,
+          batch:stmt_match(j))
+
+      if profiler then
+        export.profile_stmt(profiler, pt_ctx, batch:stmt_profile(j))
+      end
+
+      export.finish_pt_ctx(pt_ctx, dump_fd, end_pos, chunks_ctx, hooks_ctx,
+          options)
+    end
+
+    -- the final batch tells about an unfinished statement
+
+    lpos, lline, lcol, dead_end_pos = batch:pending_stmt()
+  end
+
+  if lpos then
+    local location = {lpos = lpos, lline = lline, lcol = lcol}
+    local pt_ctx = export.make_matched_pt_ctx(compiled, dump_fd, location,
+        nil, nil, dead_end_pos)
+
+    export.finish_eof_pt_ctx(pt_ctx, dump_fd, hooks_ctx, options)
+  end
+end
+
+function export.prepare_pattern_rules(pattern_rules, options)
+  -- everything split_to_chunks() makes of the rules before lexing. it could
+  -- be made once for several dumps, the shape cache is kept warm then
+
+  local keywords, keyword_ids = export.make_keywords(pattern_rules)
+
+  return {
+    keywords = keywords,
+    keyword_ids = keyword_ids,
+    compiled = options.native_matcher and
+        export.compile_pattern_rules(pattern_rules) or nil,
+    shape_cache = export.make_shape_cache(pattern_rules, options),
+  }
+end
+
 function export.split_to_chunks(lex_ctx, dump_fd, pattern_rules,
-    chunks_ctx, hooks_ctx, options)
+    chunks_ctx, hooks_ctx, options, prepared)
   local level = 1
   local pt_ctx
+  local profiler = export.make_profiler(options)
 
-  for lex_type, lex_subtype, location, value, translated_value
-      in export.lex_ctx_iter(lex_ctx, dump_fd, options) do
-    if lex_subtype == options.lex_consts.subtype_special_symbols and
-          value == ')' then
+  if not prepared then
+    prepared = export.prepare_pattern_rules(pattern_rules, options)
+  end
+
+  local keyword_ids = prepared.keyword_ids
+
+  lex_ctx:set_keywords(prepared.keywords)
+
+  if options.native_matcher and not hooks_ctx.lexeme_handler and
+      not options.lexemes_in_pt_ctx then
+    local compiled = prepared.compiled
+
+    if compiled then
+      lex_ctx:set_matcher(compiled.code, compiled.symbols, compiled.obj_types,
+          compiled.starts, #compiled.keys, #export.reserved_kw,
+          options.max_pt_states, profiler ~= nil)
+
+      export.split_to_chunks_natively(lex_ctx, dump_fd, compiled,
+          chunks_ctx, hooks_ctx, profiler, options)
+      lex_ctx:set_matcher(nil)
+
+      if profiler then export.write_profile(profiler) end
+
+      return
+    end
+  end
+
+  local shape_cache = prepared.shape_cache
+  local iter, iter_ctx = export.lex_ctx_iter(lex_ctx, dump_fd, options)
+
+  for lex_type, lex_subtype, location, value, translated_value, kw_id,
+      lex_level in iter, iter_ctx do
+    if not hooks_ctx.lexeme_handler then
+      -- the lexer tracks levels itself, unless the handler could change
+      -- lexemes
+
+      level = lex_level
+    elseif lex_subtype == options.lex_consts.subtype_special_symbols and
+        value == ')' then
       level = level - 1
+    end
 
+    if lex_subtype == options.lex_consts.subtype_special_symbols and
+          value == ')' then
       if level < 1 then
         std.error('pos(' .. location.lpos .. ') line(' .. location.lline ..
             ') col(' .. location.lcol .. '): level < 1')
@@ -322,6 +1253,13 @@ function export.split_to_chunks(lex_ctx, dump_fd, pattern_rules,
           hooks_ctx:lexeme_handler(
               lex_type, lex_subtype, location, value, translated_value, level)
 
+      -- the handler could change the lexeme, so the id is found again
+
+      if lex_subtype == options.lex_consts.subtype_simple_ident then
+        kw_id = keyword_ids[translated_value] or 0
+      else
+        kw_id = 0
+      end
     end
 
     std.assert(lex_type, 'no lex_type')
@@ -339,81 +1277,79 @@ function export.split_to_chunks(lex_ctx, dump_fd, pattern_rules,
           location = location,
           value_versions = std.setmetatable({}, {__mode = 'k'}),
         }
+
+        if profiler then
+          pt_ctx.lexeme_count = 0
+          pt_ctx.peak_states = 0
+          pt_ctx.elapsed = 0
+        end
       end
 
-      export.process_pt_ctx(pt_ctx, lex_type, lex_subtype, location,
-          value, translated_value, level, options)
+      local begin_clock = profiler and std.os.clock()
+
+      export.process_pt_ctx_by_shape(pt_ctx, shape_cache, lex_type,
+          lex_subtype, location, value, translated_value, kw_id, level,
+          options)
+
+      if profiler then
+        pt_ctx.lexeme_count = pt_ctx.lexeme_count + 1
+        pt_ctx.peak_states = std.math.max(pt_ctx.peak_states, #pt_ctx.pts)
+        pt_ctx.elapsed = pt_ctx.elapsed + std.os.clock() - begin_clock
+      end
 
       if lex_subtype == options.lex_consts.subtype_special_symbols and
           level == 1 and value == ';' then
-        local dump_data = export.extract_dump_data(dump_fd,
-            pt_ctx.location.lpos, end_pos)
-        local skip
+        if profiler then
+          export.profile_stmt(profiler, pt_ctx, pt_ctx.lexeme_count,
+              pt_ctx.peak_states, pt_ctx.elapsed)
+        end
 
-        if pt_ctx.obj_type then
+        export.finish_pt_ctx(pt_ctx, dump_fd, end_pos, chunks_ctx, hooks_ctx,
+            options)
 
-          if hooks_ctx.processed_pt_handler then
-            skip = hooks_ctx:processed_pt_handler(pt_ctx, dump_data)
-          else
-            skip = false
-          end
+        pt_ctx = nil
+      elseif #pt_ctx.pts == 0 then
+        if not pt_ctx.error_dump_data then
+          pt_ctx.error_dump_data = export.extract_dump_data(dump_fd,
+              pt_ctx.location.lpos, end_pos)
+        end
 
-          if not skip then
-            chunks_ctx:add(pt_ctx.obj_type, pt_ctx.obj_values, dump_data)
-          end
-        else
-          if hooks_ctx.unprocessed_pt_handler then
-            skip = hooks_ctx:unprocessed_pt_handler(pt_ctx, dump_data,
-                pt_ctx.error_dump_data)
-          else
-            skip = options.save_unprocessed
-          end
+        if not hooks_ctx.lexeme_handler and not options.lexemes_in_pt_ctx then
+          -- no pattern is alive, only the statement's end matters
 
-          if not skip then
-            local error_dump_data = pt_ctx.error_dump_data or '(no error_dump_data)'
+          local skipped = export.lex_ctx_iter_skip_stmt(iter_ctx,
+              profiler ~= nil)
 
-            std.error('pos(' .. pt_ctx.location.lpos .. ') line(' ..
-                pt_ctx.location.lline ..
-                ') col(' .. pt_ctx.location.lcol ..
-                '): unprocessed pattern:\n' .. dump_data ..
-                '\n' .. ('-'):rep(60) .. '\n' ..
-                error_dump_data)
+          if profiler then
+            pt_ctx.lexeme_count = pt_ctx.lexeme_count + skipped
           end
-
-          chunks_ctx:add(pt_ctx.obj_type or 'unprocessed',
-              pt_ctx.obj_values or {}, dump_data)
         end
+      elseif not hooks_ctx.lexeme_handler and
+          not options.lexemes_in_pt_ctx and
+          export.is_pt_ctx_decided(pt_ctx) then
+        -- the match is decided by the statement's end
 
-        pt_ctx = nil
-      elseif #pt_ctx.pts == 0 and not pt_ctx.error_dump_data then
-        pt_ctx.error_dump_data = export.extract_dump_data(dump_fd,
-            pt_ctx.location.lpos, end_pos)
+        local skipped = export.lex_ctx_iter_skip_stmt(iter_ctx,
+            profiler ~= nil)
+
+        if profiler then
+          pt_ctx.lexeme_count = pt_ctx.lexeme_count + skipped
+        end
       end
     end
 
-    if lex_subtype == options.lex_consts.subtype_special_symbols and
+    if hooks_ctx.lexeme_handler and
+        lex_subtype == options.lex_consts.subtype_special_symbols and
         value == '(' then
       level = level + 1
     end
   end
 
   if pt_ctx then
-    local dump_data = export.extract_dump_data(dump_fd,
-        pt_ctx.location.lpos, dump_fd:seek() + 1)
-    local skip
-
-    if hooks_ctx.unprocessed_eof_pt_handler then
-      skip = hooks_ctx:unprocessed_eof_pt_handler(pt_ctx, dump_data)
-    else
-      skip = false
-    end
-
-    if not skip then
-        std.error('pos(' .. pt_ctx.location.lpos .. ') line(' ..
-            pt_ctx.location.lline .. ') col(' .. pt_ctx.location.lcol ..
-            '): unprocessed pattern at EOF: ' .. dump_data)
-    end
+    export.finish_eof_pt_ctx(pt_ctx, dump_fd, hooks_ctx, options)
   end
+
+  if profiler then export.write_profile(profiler) end
 end
 
 return export
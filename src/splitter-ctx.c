@@ -0,0 +1,216 @@
+// abort, malloc, free
+#include <stdlib.h>
+
+// strdup
+#include <string.h>
+
+// fprintf, stderr
+#include <stdio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// luaL_openlibs
+#include <lualib.h>
+
+#include "pg-dump-splitter.h"
+
+struct pg_dump_splitter_ctx
+{
+    lua_State *L;
+    int splitter_ctx_ref;   // made by pg_dump_splitter.make_splitter_ctx()
+    char *err;              // message of the last error, 0 if none
+};
+
+static int
+traceback_msgh (lua_State *L)
+{
+    const char *msg = lua_tostring (L, 1);
+
+    luaL_traceback (L, L, msg, 0);
+
+    return 1;
+}
+
+static int
+make_ctx_in_lua (lua_State *L)
+{
+    const struct pg_dump_splitter_options *options = lua_touserdata (L, 1);
+
+    open_pg_dump_splitter (L);
+
+    lua_getfield (L, -1, "make_default_options");
+    lua_call (L, 0, 1); // returns var: options
+
+    if (options->save_unprocessed)
+    {
+        lua_pushboolean (L, 1);
+        lua_setfield (L, -2, "save_unprocessed");
+    }
+    if (options->no_schema_dirs)
+    {
+        lua_pushboolean (L, 1);
+        lua_setfield (L, -2, "no_schema_dirs");
+    }
+    if (options->relaxed_order)
+    {
+        lua_pushboolean (L, 1);
+        lua_setfield (L, -2, "relaxed_order");
+    }
+    if (options->split_stateless)
+    {
+        lua_pushboolean (L, 1);
+        lua_setfield (L, -2, "split_stateless");
+    }
+    if (options->sql_footer)
+    {
+        lua_pushstring (L, options->sql_footer);
+        lua_setfield (L, -2, "sql_footer");
+    }
+    if (options->profile_path)
+    {
+        lua_pushstring (L, options->profile_path);
+        lua_setfield (L, -2, "profile_path");
+    }
+    if (options->jobs > 1)
+    {
+        lua_pushinteger (L, options->jobs);
+        lua_setfield (L, -2, "jobs");
+    }
+
+    lua_getfield (L, -2, "make_splitter_ctx");
+    lua_pushstring (L, options->hooks_path);
+    lua_pushvalue (L, -3); // var: options
+    lua_call (L, 2, 1); // returns var: splitter_ctx
+
+    return 1;
+}
+
+static void
+set_error (struct pg_dump_splitter_ctx *ctx, const char *msg)
+{
+    free (ctx->err);
+    ctx->err = 0;
+
+    if (!msg) return;
+
+    ctx->err = strdup (msg);
+
+    if (__builtin_expect (!ctx->err, 0))
+    {
+        fprintf (stderr, "memory allocation error for error message\n");
+        abort ();
+    }
+}
+
+struct pg_dump_splitter_ctx *
+pg_dump_splitter_make_ctx (const struct pg_dump_splitter_options *options)
+{
+    struct pg_dump_splitter_ctx *ctx = malloc (sizeof (*ctx));
+    lua_State *L = luaL_newstate ();
+
+    if (__builtin_expect (!ctx || !L, 0))
+    {
+        fprintf (stderr, "memory allocation error for splitter context\n");
+        abort ();
+    }
+
+    *ctx = (struct pg_dump_splitter_ctx)
+    {
+        .L = L,
+        .splitter_ctx_ref = LUA_NOREF,
+    };
+
+    luaL_openlibs (L);
+
+    lua_pushcfunction (L, traceback_msgh);
+    lua_pushcfunction (L, make_ctx_in_lua);
+    lua_pushlightuserdata (L, (void *) options);
+
+    if (lua_pcall (L, 1, 1, -3))
+    {
+        set_error (ctx, lua_tostring (L, -1));
+    }
+    else
+    {
+        ctx->splitter_ctx_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+
+    lua_settop (L, 0);
+
+    return ctx;
+}
+
+static int
+call_split (struct pg_dump_splitter_ctx *ctx, const char *method,
+        int arg_count)
+{
+    // the arguments are on the stack already
+
+    lua_State *L = ctx->L;
+    int base = lua_gettop (L) - arg_count;
+
+    if (ctx->splitter_ctx_ref == LUA_NOREF)
+    {
+        // the error of making the context is kept
+
+        lua_settop (L, 0);
+
+        return -1;
+    }
+
+    lua_pushcfunction (L, traceback_msgh);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->splitter_ctx_ref);
+    lua_getfield (L, -1, method);
+    lua_insert (L, -2);
+    lua_rotate (L, base + 1, 3);
+
+    int lua_err = lua_pcall (L, arg_count + 1, 0, base + 1);
+
+    set_error (ctx, lua_err ? lua_tostring (L, -1) : 0);
+    lua_settop (L, 0);
+
+    // the dump's garbage is not kept till the next dump
+
+    lua_gc (L, LUA_GCCOLLECT, 0);
+
+    return lua_err ? -1 : 0;
+}
+
+int
+pg_dump_splitter_split (struct pg_dump_splitter_ctx *ctx,
+        const char *dump_path, const char *output_dir)
+{
+    lua_pushstring (ctx->L, dump_path);
+    lua_pushstring (ctx->L, output_dir);
+
+    return call_split (ctx, "split", 2);
+}
+
+int
+pg_dump_splitter_split_buffer (struct pg_dump_splitter_ctx *ctx,
+        const char *data, size_t size, const char *output_dir)
+{
+    lua_pushlstring (ctx->L, data, size);
+    lua_pushstring (ctx->L, output_dir);
+
+    return call_split (ctx, "split_buffer", 2);
+}
+
+const char *
+pg_dump_splitter_error (const struct pg_dump_splitter_ctx *ctx)
+{
+    return ctx->err;
+}
+
+void
+pg_dump_splitter_free_ctx (struct pg_dump_splitter_ctx *ctx)
+{
+    if (!ctx) return;
+
+    lua_close (ctx->L);
+    free (ctx->err);
+    free (ctx);
+}
+
+// vi:ts=4:sw=4:et
@@ -61,6 +61,7 @@ struct arguments
     int relaxed_order;
     int split_stateless;
     wchar_t *sql_footer;
+    wchar_t *profile_path;
     wchar_t *dump_path;
     wchar_t *output_dir;
     wchar_t *hooks_path;
@@ -134,6 +135,26 @@ parse_args (struct arguments *arguments, int argc, wchar_t *argv[])
                 ++i;
                 continue;
             }
+            if (!wcscmp (L"-P", arg) || !wcscmp (L"--profile", arg))
+            {
+                if (!next_arg)
+                {
+                    fwprintf (stderr,
+                            L"option requires an argument: %ls", arg);
+                    return 1;
+                }
+                if (arguments->profile_path)
+                {
+                    fwprintf (stderr,
+                            L"attempt to redefine argument for option: %ls",
+                            arg);
+                    return 1;
+                }
+
+                arguments->profile_path = wcsdup (next_arg);
+                ++i;
+                continue;
+            }
             if (!wcscmp (L"-k", arg) || !wcscmp (L"--hooks", arg))
             {
                 if (!next_arg)
@@ -221,11 +242,16 @@ bootstrap (lua_State *L)
         lua_pushvalue (L, 5);
         lua_setfield (L, -2, "sql_footer");
     }
+    if (lua_toboolean (L, 6)) // arg: profile_path
+    {
+        lua_pushvalue (L, 6);
+        lua_setfield (L, -2, "profile_path");
+    }
 
     lua_getfield (L, -2, "pg_dump_splitter");
-    lua_pushvalue (L, 6); // arg: dump_path
-    lua_pushvalue (L, 7); // arg: output_dir
-    lua_pushvalue (L, 8); // arg: hooks_path
+    lua_pushvalue (L, 7); // arg: dump_path
+    lua_pushvalue (L, 8); // arg: output_dir
+    lua_pushvalue (L, 9); // arg: hooks_path
     lua_pushvalue (L, -5); // var: options
     lua_call (L, 4, 0);
 
@@ -278,6 +304,9 @@ wmain (int argc, wchar_t *argv[], wchar_t *envp[] __attribute__ ((unused)))
     mbs = pds_os_helpers_make_mbs_from_wcs (arguments.sql_footer);
     lua_pushstring (L, mbs);
     free (mbs);
+    mbs = pds_os_helpers_make_mbs_from_wcs (arguments.profile_path);
+    lua_pushstring (L, mbs);
+    free (mbs);
     mbs = pds_os_helpers_make_mbs_from_wcs (arguments.dump_path);
     lua_pushstring (L, mbs);
     free (mbs);
@@ -288,7 +317,7 @@ wmain (int argc, wchar_t *argv[], wchar_t *envp[] __attribute__ ((unused)))
     lua_pushstring (L, mbs);
     free (mbs);
 
-    int lua_err = lua_pcall (L, 8, 0, -10);
+    int lua_err = lua_pcall (L, 9, 0, -11);
 
     if (lua_err)
     {
@@ -306,6 +335,7 @@ out:
     free (arguments.hooks_path);
     free (arguments.output_dir);
     free (arguments.dump_path);
+    free (arguments.profile_path);
     free (arguments.sql_footer);
 
     return exit_code;